@@ -0,0 +1,41 @@
+// Lines drawn before the highlight frontier reaches them get a display
+// without hl. Catching up to them must size hl for their rendered length,
+// which tabs make longer than their bytes.
+#define main winkilo_main
+#include "../winkilo.c"
+#undef main
+
+int main(void)
+{
+	const char *path = "hl_tabs.tmp.c";
+	FILE *fp = fopen(path, "wb");
+	int j, k, at = KILO_HL_SYNC_LINES;
+
+	for (j = 0; j < at + 1000; j++)
+	{
+		for (k = 0; j >= at && k < 60; k++)
+			fputc('\t', fp);
+		fprintf(fp, "foo %d;\n", j);
+	}
+	fclose(fp);
+
+	E.term = &HeadlessBackend;
+	InitEditorConsole();
+	EditorOpen((char *)path);
+
+	// Drawn far ahead of the frontier, as after a jump to a match.
+	EditorLineRender(EditorLine(at));
+	EditorSyntaxCatchUp(at + 100);
+	linedisp_t *d = EditorLineDisplay(at);
+
+	char text[32];
+	int ok = d->rsize == 60 * KILO_TAB_STOP + snprintf(text, sizeof(text), "foo %d;", at) && d->hlruns > 0;
+	JournalClose(true);
+	remove(path);
+	if (!ok)
+	{
+		fprintf(stderr, "hl_tabs: rsize %u, %u runs\n", d->rsize, d->hlruns);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,52 @@
+// The end of a bracketed paste split across two reads must still end the
+// paste, or every key after it is pasted too.
+#define main winkilo_main
+#include "../winkilo.c"
+#undef main
+
+// Replays a paste of n bytes followed by Enter and 'Z', handing out at most
+// chunk bytes per read, 0 for as many as fit. Whether the keys after the
+// paste were typed.
+bool PasteSplit(size_t n, size_t chunk)
+{
+	static char script[8192];
+	size_t len = 0;
+
+	memcpy(&script[len], "\x1b[200~", 6);
+	len += 6;
+	memset(&script[len], 'a', n);
+	len += n;
+	memcpy(&script[len], "\x1b[201~\rZ", 8);
+	len += 8;
+
+	BenchResetLines();
+	E.cursor.X = E.cursor.Y = 0;
+	E.input.pasting = false;
+	Headless.input = script;
+	Headless.inputlen = len;
+	Headless.pos = 0;
+	Headless.chunk = chunk;
+	while (Headless.pos < Headless.inputlen || E.input.head < E.input.len)
+		HandleKeyPress();
+
+	bool ok = !E.input.pasting && E.linesnum == 2 && EditorLine(0)->size == n &&
+		EditorLine(1)->size == 1 && EditorLine(1)->bytes[0] == 'Z';
+	if (!ok)
+		fprintf(stderr, "paste_split: %zu bytes in reads of %zu, %zu lines\n", n, chunk, E.linesnum);
+	return ok;
+}
+
+int main(void)
+{
+	bool ok = true;
+
+	E.term = &HeadlessBackend;
+	InitEditorConsole();
+
+	// Cut at every byte of the markers, and where a full read cuts them.
+	for (size_t chunk = 1; chunk <= 8; chunk++)
+		for (size_t n = 1; n <= 8; n++)
+			ok = PasteSplit(n, chunk) && ok;
+	ok = PasteSplit(BUFF_MAX * 4 - 8, 0) && ok;
+	return ok ? 0 : 1;
+}
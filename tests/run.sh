@@ -0,0 +1,29 @@
+#!/bin/sh
+# Builds each test in this directory against winkilo.c with AddressSanitizer
+# and UBSan, which stops a test at its first report, and runs it in a
+# scratch directory. Exits non-zero if any test fails.
+#   sh tests/run.sh [CC]
+
+cc=${1:-cc}
+dir=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+failed=0
+
+export ASAN_OPTIONS=detect_leaks=0
+for src in "$dir"/*.c; do
+	name=$(basename "$src" .c)
+	if ! $cc -g -O1 -fsanitize=address,undefined -fno-sanitize-recover=undefined -w -o "$work/$name" "$src" -lpthread; then
+		echo "FAIL $name (build)"
+		failed=1
+		continue
+	fi
+	if (cd "$work" && ./"$name" </dev/null >"$name.log" 2>&1); then
+		echo "ok   $name"
+	else
+		echo "FAIL $name"
+		cat "$work/$name.log"
+		failed=1
+	fi
+done
+exit $failed
@@ -0,0 +1,37 @@
+// An empty file has no mapping. Opening, drawing, editing and saving it
+// must not hand a NULL line to the C library.
+#define main winkilo_main
+#include "../winkilo.c"
+#undef main
+
+int main(void)
+{
+	const char *path = "save_empty.tmp";
+	FILE *fp = fopen(path, "wb");
+	char text[8];
+	size_t n;
+
+	fclose(fp);
+	E.term = &HeadlessBackend;
+	InitEditorConsole();
+	EditorOpen((char *)path);
+	EditorRefreshScreen();
+	Undo.step++;
+	EditorInsertChar('x');
+	EditorInsertNewLine();
+	EditorInsertChar('y');
+	EditorRefreshScreen();
+	EditorSave();
+	EditorSaveFinish(true);
+
+	fp = fopen(path, "rb");
+	n = fp ? fread(text, 1, sizeof(text), fp) : 0;
+	if (fp)
+		fclose(fp);
+	bool ok = !E.dirty && n == 3 && !memcmp(text, "x\ny", 3);
+	if (!ok)
+		fprintf(stderr, "save_empty: saved %zu bytes\n", n);
+	JournalClose(true);
+	remove(path);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,79 @@
+// Saving through a symbolic link writes the file it points to and keeps
+// the link, and saving a file with hard links keeps every name on it.
+#define main winkilo_main
+#include "../winkilo.c"
+#undef main
+#include <sys/wait.h>
+
+// Whether path holds the lines in the editor.
+bool SavedAsShown(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	size_t j;
+	int c = 0;
+
+	for (j = 0; fp && j < E.linesnum; j++)
+	{
+		line_t *line = EditorLine(j);
+		for (size_t k = 0; k < line->size; k++)
+			if ((c = fgetc(fp)) != (unsigned char)line->bytes[k])
+				break;
+		c = fgetc(fp);
+		if (c != (j + 1 < E.linesnum ? '\n' : EOF))
+			break;
+	}
+	if (fp)
+		fclose(fp);
+	return fp && j == E.linesnum;
+}
+
+// Opens name, another name for file, inserts text that rewrites the file
+// and saves.
+bool SaveLinked(const char *file, const char *name, bool symbolic)
+{
+	struct stat st;
+	FILE *fp = fopen(file, "wb");
+
+	for (int j = 0; j < 1000; j++)
+		fprintf(fp, "line %04d of a linked file\n", j);
+	fclose(fp);
+	if ((symbolic ? symlink(file, name) : link(file, name)) != 0)
+		return false;
+	EditorOpen((char *)name);
+	Undo.step++;
+	EditorLineInsertText(3, 0, "X", 1);
+	EditorSave();
+	EditorSaveFinish(true);
+
+	bool ok = !E.dirty && SavedAsShown(file) && SavedAsShown(name) && lstat(name, &st) == 0;
+	ok = ok && (symbolic ? S_ISLNK(st.st_mode) : st.st_nlink == 2);
+	ok = ok && access("save_links.file" KILO_SAVE_SUFFIX, F_OK) != 0;
+	if (!ok)
+		fprintf(stderr, "save_links: saving through a %s link broke it\n", symbolic ? "symbolic" : "hard");
+	JournalClose(true);
+	remove(name);
+	remove(file);
+	return ok;
+}
+
+// Runs each case in a process of its own, as the editor holds one file.
+bool Case(bool symbolic)
+{
+	int status;
+	pid_t pid = fork();
+
+	if (pid == 0)
+	{
+		E.term = &HeadlessBackend;
+		InitEditorConsole();
+		_exit(SaveLinked("save_links.file", "save_links.link", symbolic) ? 0 : 1);
+	}
+	return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(void)
+{
+	bool ok = Case(true);
+	ok = Case(false) && ok;
+	return ok ? 0 : 1;
+}
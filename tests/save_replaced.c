@@ -0,0 +1,87 @@
+// A file replaced by another program after it was opened must not be
+// patched in place or copied from: the save writes the text in full.
+#define main winkilo_main
+#include "../winkilo.c"
+#undef main
+#include <sys/wait.h>
+
+// Writes lines of the same length, each starting with c.
+void WriteLines(const char *path, char c, int n)
+{
+	FILE *fp = fopen(path, "wb");
+	for (int j = 0; j < n; j++)
+		fprintf(fp, "%c line %06d of a file\n", c, j);
+	fclose(fp);
+}
+
+// Whether path holds the lines in the editor.
+bool SavedAsShown(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	size_t j;
+	int c = 0;
+
+	for (j = 0; fp && j < E.linesnum; j++)
+	{
+		line_t *line = EditorLine(j);
+		for (size_t k = 0; k < line->size; k++)
+			if ((c = fgetc(fp)) != (unsigned char)line->bytes[k])
+				break;
+		c = fgetc(fp);
+		if (c != (j + 1 < E.linesnum ? '\n' : EOF))
+			break;
+	}
+	if (fp)
+		fclose(fp);
+	return fp && j == E.linesnum;
+}
+
+// Opens n lines and changes one, keeping its length with same, lets another
+// program replace the file with other lines of the same size and saves.
+bool SaveReplaced(int n, bool same)
+{
+	const char *path = "save_replaced.tmp";
+	const char *other = "save_replaced.other";
+
+	WriteLines(path, 'a', n);
+	EditorOpen((char *)path);
+	Undo.step++;
+	if (same)
+		EditorLineDelText(3, 0, 1);
+	EditorLineInsertText(3, 0, "X", 1);
+	WriteLines(other, 'b', n);
+	rename(other, path);
+
+	EditorSave();
+	EditorSaveFinish(true);
+	bool ok = !E.dirty && SavedAsShown(path) && EditorLine(4)->bytes[0] == 'a';
+	if (!ok)
+		fprintf(stderr, "save_replaced: %d lines saved wrong, %s\n", n, same ? "patched" : "copied");
+	JournalClose(true);
+	remove(path);
+	return ok;
+}
+
+// Runs each case in a process of its own, as the editor holds one file.
+bool Case(int n, bool same)
+{
+	int status;
+	pid_t pid = fork();
+
+	if (pid == 0)
+	{
+		E.term = &HeadlessBackend;
+		InitEditorConsole();
+		_exit(SaveReplaced(n, same) ? 0 : 1);
+	}
+	return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(void)
+{
+	// An edit keeping the length is patched in place, others copy the
+	// unchanged stretches.
+	bool ok = Case(200, true);
+	ok = Case(200000, false) && ok;
+	return ok ? 0 : 1;
+}
@@ -1,6 +1,25 @@
 /*** Includes ***/
+#ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#include <psapi.h>
+#include <io.h>
+#else
+#ifdef __linux__
+#define _GNU_SOURCE	// copy_file_range
+#endif
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#endif
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -10,6 +29,19 @@
 #include <string.h>
 #include <sys/types.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define KILO_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define KILO_TARGET_AVX2
+#else
+#include <cpuid.h>
+#define KILO_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
 
 /*** Defines ***/
 #define ESC "\x1b"
@@ -22,6 +54,37 @@
 #define KILO_TAB_STOP 4
 #define KILO_QUIT_TIMES 3
 #define KILO_TITLE "WinKilo - v" KILO_VERSION
+#define KILO_MAX_THREADS 16
+#define KILO_INDEX_CHUNK (64 << 20)	// Smallest file slice indexed by its own thread.
+#define KILO_HL_WORKER 1		// Highlight ahead of the viewport on a background thread.
+#define KILO_HL_BATCH 1024		// Lines the highlight worker takes per snapshot.
+#define KILO_HL_BATCH_BYTES (1 << 20)	// Bytes the highlight worker copies per snapshot.
+#define KILO_HL_SYNC_LINES 4096	// Larger highlight gaps are left to the worker.
+#define KILO_HL_POLL_MS 50		// Redraw interval while waiting for the worker.
+#define KILO_SPAN_GAP 8			// Unchanged cells worth rewriting to save a cursor move.
+#define KILO_FRAME_RATE 60		// Most frames drawn per second.
+#define KILO_PASTE_RUN 16		// Typed runs this long in one read are inserted as a paste.
+#define KILO_ESC_WAIT_MS 50		// How long the rest of an escape sequence cut off by a read is waited for.
+#define KILO_PERF_AVERAGE 16	// Frames in the rolling averages of the performance overlay.
+#define KILO_SEARCH_SIMD_MAX 32	// Longest query searched with the SSE2 filter.
+#define KILO_SEARCH_BLOCK (1 << 20)	// Most bytes of adjacent lines searched in one call.
+#define KILO_FIND_CHUNK_LINES 65536	// Fewest lines searched by a thread of their own.
+#define KILO_FIND_MAX_MATCHES (1 << 22)	// Most matches kept in the find index.
+#define KILO_FIND_CACHE 16		// Earlier result sets kept while the find prompt is open.
+#define KILO_RE_DFA_STATES 4096	// DFA states cached per regex before starting over.
+#define KILO_UNDO_MAX (64 << 20)	// Most bytes kept in the undo log.
+#define KILO_UNDO_RUN 256		// Most typed characters undone at once.
+#define KILO_JOURNAL_SUFFIX ".wkj"	// Appended to the file name for its journal.
+#define KILO_JOURNAL_BATCH_MS 20	// Longest a journaled edit waits to be written while editing.
+#define KILO_JOURNAL_SYNC_MS 1000	// Longest a journaled edit waits to be synced to disk.
+#define KILO_JOURNAL_SAMPLE 65536	// Bytes hashed at each end of a file to tell its journal apart.
+#define KILO_SAVE_SUFFIX ".wks"		// Appended to the file name for the copy being saved.
+#define KILO_SAVE_BUFFER (4 << 20)	// Bytes gathered per write when saving.
+#define KILO_SAVE_COPY_MIN (1 << 20)	// Shortest unchanged stretch of a file copied by the kernel.
+#define KILO_SAVE_PATCH 4		// Saves changing at most 1/4 of a file patch it in place.
+#define KILO_SLAB_SIZE (1 << 20)	// Bytes of each slab edited lines are kept in.
+#define KILO_SLAB_MAX 4096		// Largest slab chunk, longer lines go to malloc.
+#define KILO_DISP_CACHE 1024		// Lines whose render and hl are cached, more than fit on screen.
 
 enum EditorKey {
 	BACKSPACE = 127,
@@ -33,7 +96,11 @@ enum EditorKey {
 	HOME_KEY,
 	END_KEY,
 	PAGE_UP,
-	PAGE_DOWN
+	PAGE_DOWN,
+	PASTE_BEGIN,
+	PASTE_END,
+	PASTE_TEXT,	// A block of text in E.input.paste.
+	INPUT_END	// No more input: it ran out, or reading it failed.
 };
 
 enum EditorHighlight {
@@ -50,6 +117,401 @@ enum EditorHighlight {
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+// Byte classes of a compiled syntax.
+#define CLS_SEP (1<<0)		// Separates tokens.
+#define CLS_DIGIT (1<<1)	// Starts or continues a number.
+#define CLS_NUMBER (1<<2)	// Continues a number.
+#define CLS_QUOTE (1<<3)	// Opens and closes a string.
+#define CLS_SCS (1<<4)		// First byte of the single line comment start.
+#define CLS_MCS (1<<5)		// First byte of the multiline comment start.
+#define CLS_MCE (1<<6)		// First byte of the multiline comment end.
+
+#define KILO_SEPARATORS ",.()+-/*=~%<>[];"
+
+/*** Platform ***/
+
+// Tells whether a path still names the file opened earlier.
+typedef struct fileid {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime;
+} fileid_t;
+
+#ifdef _WIN32
+typedef struct thread {
+	HANDLE handle;
+	void (*fn)(void *);
+	void *arg;
+} thread_t;
+
+DWORD WINAPI ThreadMain(LPVOID param)
+{
+	thread_t *t = param;
+	t->fn(t->arg);
+	return 0;
+}
+
+int ThreadStart(thread_t *t, void (*fn)(void *), void *arg)
+{
+	t->fn = fn;
+	t->arg = arg;
+	t->handle = CreateThread(NULL, 0, ThreadMain, t, 0, NULL);
+	return t->handle != NULL;
+}
+
+void ThreadJoin(thread_t *t)
+{
+	WaitForSingleObject(t->handle, INFINITE);
+	CloseHandle(t->handle);
+}
+
+typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+
+void MutexInit(mutex_t *m) { InitializeCriticalSection(m); }
+void MutexLock(mutex_t *m) { EnterCriticalSection(m); }
+void MutexUnlock(mutex_t *m) { LeaveCriticalSection(m); }
+void CondInit(cond_t *c) { InitializeConditionVariable(c); }
+void CondWait(cond_t *c, mutex_t *m) { SleepConditionVariableCS(c, m, INFINITE); }
+void CondWaitFor(cond_t *c, mutex_t *m, int ms) { SleepConditionVariableCS(c, m, ms); }
+void CondSignal(cond_t *c) { WakeConditionVariable(c); }
+
+int ThreadCount(void)
+{
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	if (si.dwNumberOfProcessors < 1) return 1;
+	if (si.dwNumberOfProcessors > KILO_MAX_THREADS) return KILO_MAX_THREADS;
+	return si.dwNumberOfProcessors;
+}
+
+// Seconds from an arbitrary starting point, for timing.
+double ClockNow(void)
+{
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart / freq.QuadPart;
+}
+
+int LastError(void)
+{
+	return GetLastError();
+}
+
+// Modification time of a file, 0 if it can't be read.
+int64_t FileTime(char *filename)
+{
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (!GetFileAttributesExA(filename, GetFileExInfoStandard, &data))
+		return 0;
+	return ((int64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+}
+
+bool FileHandleId(HANDLE h, fileid_t *id)
+{
+	BY_HANDLE_FILE_INFORMATION info;
+	if (!GetFileInformationByHandle(h, &info))
+		return false;
+	id->dev = info.dwVolumeSerialNumber;
+	id->ino = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+	id->size = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+	id->mtime = ((int64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+	return true;
+}
+
+bool FileId(FILE *fp, fileid_t *id)
+{
+	return FileHandleId((HANDLE)_get_osfhandle(_fileno(fp)), id);
+}
+
+// Flushes what was written to fp through to the disk.
+void FileSync(FILE *fp)
+{
+	FlushFileBuffers((HANDLE)_get_osfhandle(_fileno(fp)));
+}
+
+// Renames from over to in one step, so that to is never left half written.
+bool FileReplace(char *from, char *to)
+{
+	return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+}
+
+// The path of the file path names, for a copy to be renamed over. Links
+// are left as they are here.
+char *FileResolve(const char *path)
+{
+	return strdup(path);
+}
+
+bool FileSeek(FILE *fp, uint64_t off)
+{
+	return _fseeki64(fp, (__int64)off, SEEK_SET) == 0;
+}
+
+// Copies len bytes at off in from to to inside the kernel. Not available
+// here, so nothing is copied.
+size_t FileCopyRange(FILE *from, uint64_t off, FILE *to, size_t len)
+{
+	return 0;
+}
+
+// Peak memory use of the process in bytes.
+size_t PeakRSS(void)
+{
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+		return 0;
+	return pmc.PeakWorkingSetSize;
+}
+#else
+typedef struct thread {
+	pthread_t handle;
+	void (*fn)(void *);
+	void *arg;
+} thread_t;
+
+void *ThreadMain(void *param)
+{
+	thread_t *t = param;
+	t->fn(t->arg);
+	return NULL;
+}
+
+int ThreadStart(thread_t *t, void (*fn)(void *), void *arg)
+{
+	t->fn = fn;
+	t->arg = arg;
+	return pthread_create(&t->handle, NULL, ThreadMain, t) == 0;
+}
+
+void ThreadJoin(thread_t *t)
+{
+	pthread_join(t->handle, NULL);
+}
+
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+
+void MutexInit(mutex_t *m) { pthread_mutex_init(m, NULL); }
+void MutexLock(mutex_t *m) { pthread_mutex_lock(m); }
+void MutexUnlock(mutex_t *m) { pthread_mutex_unlock(m); }
+void CondInit(cond_t *c) { pthread_cond_init(c, NULL); }
+void CondWait(cond_t *c, mutex_t *m) { pthread_cond_wait(c, m); }
+void CondSignal(cond_t *c) { pthread_cond_signal(c); }
+
+void CondWaitFor(cond_t *c, mutex_t *m, int ms)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	pthread_cond_timedwait(c, m, &ts);
+}
+
+int ThreadCount(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1) return 1;
+	if (n > KILO_MAX_THREADS) return KILO_MAX_THREADS;
+	return n;
+}
+
+// Seconds from an arbitrary starting point, for timing.
+double ClockNow(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int LastError(void)
+{
+	return errno;
+}
+
+// Modification time of a file, 0 if it can't be read.
+int64_t FileTime(char *filename)
+{
+	struct stat st;
+	if (stat(filename, &st) != 0)
+		return 0;
+	return st.st_mtime;
+}
+
+bool FileDescId(int fd, fileid_t *id)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return false;
+	id->dev = st.st_dev;
+	id->ino = st.st_ino;
+	id->size = st.st_size;
+	id->mtime = st.st_mtime;
+	return true;
+}
+
+bool FileId(FILE *fp, fileid_t *id)
+{
+	return FileDescId(fileno(fp), id);
+}
+
+// Flushes what was written to fp through to the disk.
+void FileSync(FILE *fp)
+{
+	fsync(fileno(fp));
+}
+
+// Writes the contents of from over to in place and removes from. Unlike a
+// rename this keeps every name of a file with hard links, but a crash
+// halfway leaves the text only in from.
+bool FileCopyOver(char *from, char *to)
+{
+	char *buf = malloc(KILO_SAVE_BUFFER);
+	FILE *in = fopen(from, "rb");
+	FILE *out = (buf && in) ? fopen(to, "wb") : NULL;
+	bool ok = out != NULL;
+	size_t n;
+
+	while (ok && (n = fread(buf, 1, KILO_SAVE_BUFFER, in)) > 0)
+		ok = fwrite(buf, 1, n, out) == n;
+	ok = ok && !ferror(in) && fflush(out) == 0;
+	if (ok)
+		FileSync(out);
+	if (out)
+		ok = (fclose(out) == 0) && ok;
+	if (in)
+		fclose(in);
+	free(buf);
+	if (ok)
+		remove(from);
+	return ok;
+}
+
+// Renames from over to in one step, so that to is never left half written.
+// from takes the owner and permissions of to, and the rename is synced to
+// the disk. A file with other hard links is written over in place instead.
+bool FileReplace(char *from, char *to)
+{
+	struct stat st;
+
+	if (stat(to, &st) == 0)
+	{
+		if (st.st_nlink > 1)
+			return FileCopyOver(from, to);
+		// Only root can give a file away; failing that, keep the group.
+		if (chown(from, st.st_uid, st.st_gid) != 0 && chown(from, (uid_t)-1, st.st_gid) != 0)
+			errno = 0;
+		chmod(from, st.st_mode & 07777);
+	}
+	if (rename(from, to) != 0)
+		return false;
+
+	char *slash = strrchr(to, '/');
+	char *dir = slash ? strndup(to, slash == to ? 1 : slash - to) : strdup(".");
+	int fd = open(dir, O_RDONLY);
+	if (fd != -1)
+	{
+		fsync(fd);
+		close(fd);
+	}
+	free(dir);
+	return true;
+}
+
+// The path of the file path names, with symbolic links resolved, so that
+// a copy renamed over it replaces the file and not the link.
+char *FileResolve(const char *path)
+{
+	char *real = realpath(path, NULL);
+	return real ? real : strdup(path);
+}
+
+bool FileSeek(FILE *fp, uint64_t off)
+{
+	return fseeko(fp, (off_t)off, SEEK_SET) == 0;
+}
+
+// Copies len bytes at off in from to to inside the kernel, which can share
+// the extents on file systems with reflinks. Returns the bytes copied,
+// short when the kernel can't copy between the two files.
+size_t FileCopyRange(FILE *from, uint64_t off, FILE *to, size_t len)
+{
+	size_t done = 0;
+#ifdef __linux__
+	loff_t in = (loff_t)off;
+	while (done < len)
+	{
+		ssize_t n = copy_file_range(fileno(from), &in, fileno(to), NULL, len - done, 0);
+		if (n <= 0)
+			break;
+		done += (size_t)n;
+	}
+#endif
+	return done;
+}
+
+// Peak memory use of the process in bytes.
+size_t PeakRSS(void)
+{
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		return 0;
+#ifdef __APPLE__
+	return ru.ru_maxrss;
+#else
+	return (size_t)ru.ru_maxrss * 1024;
+#endif
+}
+#endif
+
+int CountTrailingZeros(unsigned int mask)
+{
+#ifdef _MSC_VER
+	unsigned long idx;
+	_BitScanForward(&idx, mask);
+	return idx;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+bool CpuHasAVX2(void)
+{
+#if KILO_X86
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) return false;
+	__cpuid(info, 1);
+	if (!(info[2] & (1 << 27))) return false;	// OSXSAVE
+	if ((_xgetbv(0) & 6) != 6) return false;	// OS saves YMM state
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	unsigned int a, b, c, d, lo, hi;
+	if (__get_cpuid_max(0, NULL) < 7) return false;
+	__cpuid(1, a, b, c, d);
+	if (!(c & (1 << 27))) return false;
+	__asm__ ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	if ((lo & 6) != 6) return false;
+	__cpuid_count(7, 0, a, b, c, d);
+	return (b & (1 << 5)) != 0;
+#endif
+#else
+	return false;
+#endif
+}
+
 /*** Data ***/
 struct EditorSyntax {
 	char *filetype;
@@ -59,35 +521,128 @@ struct EditorSyntax {
 	char *multiline_comment_start;
 	char *multiline_comment_end;
 	int flags;
+	char *quotes;			// String delimiters, NULL for \" and '.
+	char *number_chars;		// Bytes continuing a number, NULL for '.'.
+	char *separators;		// Token separators besides blanks, NULL for KILO_SEPARATORS.
+	struct KeywordTable *kwtable;	// Compiled from keywords on first use.
+	unsigned char *classes;		// Byte classes, compiled on first use.
 };
 
+// A line takes 16 bytes, whatever the file size. The bytes of lines that
+// were edited live in slab chunks. How a line is drawn is only cached for
+// the lines drawn last. Lines are at most 4 GB long.
 typedef struct line {
-	int idx;
-	size_t size;
-	size_t rsize;
 	char *bytes;
-	char *render;
-	unsigned char *hl;
-	int hl_open_comment;
+	uint32_t size;
+	unsigned int disp : 28;		// Display cache key, 0 for none. Dropped when the bytes change.
+	unsigned int mapped : 1;	// bytes are borrowed from E.base or a save in progress, maybe not NUL terminated.
+	unsigned int hl_open_comment : 1;	// Multiline comment still open at the end of the line.
+	signed int hl_entry : 2;	// Comment state hl was built for, -1 when stale.
 } line_t;
 
+// How a drawn line looks: its tabs expanded and its highlight.
+typedef struct linedisp {
+	char *render;		// Tabs expanded, only used when tabs is set: otherwise the bytes are drawn as they are.
+	unsigned char *hl;	// Runs of a length up to 255 and a highlight.
+	uint32_t rsize;
+	uint32_t hlruns;
+	size_t rcap;
+	size_t hlcap;
+	bool tabs;
+	int entry;		// Comment state hl was built for, -1 until built.
+	uint32_t key;		// disp of the line, 0 when unused.
+	uint32_t hnext;		// Next entry in the same hash bucket.
+	uint32_t prev;		// Neighbours in least recently used order.
+	uint32_t next;
+} linedisp_t;
+
+typedef struct pos {
+	int X;
+	int Y;
+} pos_t;
+
+// Screen cells, one glyph and one attribute each, kept in two planes so
+// that runs of glyphs copy in and out with memcpy. An attribute is an SGR
+// colour (0 for the default) optionally combined with ATTR_INVERSE.
+typedef struct screen {
+	char *ch;
+	unsigned char *attr;
+} screen_t;
+
+#define ATTR_INVERSE 0x80
+
+// Keys decoded from console input and not handled yet. Text typed or
+// pasted in a run is collected in text and queued as a single PASTE_TEXT
+// key followed by its offset and length.
+struct KeyQueue {
+	int *keys;
+	size_t head;	// Next key to hand out.
+	size_t len;
+	size_t cap;
+	char *text;
+	size_t textlen;
+	size_t textcap;
+	size_t run;	// Start of the run being collected in text.
+	bool pasting;	// Inside a bracketed paste.
+	char *paste;	// Text of the last PASTE_TEXT handed out.
+	size_t pastelen;
+	char carry[16];	// Start of an escape sequence cut off at the end of a read.
+	int carrylen;
+	bool ended;	// Input ran out, INPUT_END is handed out from now on.
+	bool failed;	// Reading input failed.
+};
+
+// A terminal backend owns the console: raw mode, input and output. Input
+// is handed over as the bytes a VT terminal would send, resizes are applied
+// to E.bufSize as they are read.
+struct TerminalBackend {
+	char *name;
+	int (*init)(void);		// Enters raw mode and sets E.bufSize, 0 on failure.
+	void (*exit)(void);		// Restores the terminal.
+	bool (*wait)(int ms);		// Whether input arrives within ms, -1 waits forever.
+	int (*read)(char *buf, int size);	// Reads pending input, blocking until some. -1 on error, -2 once input ran out.
+	void (*write)(const char *buf, int len);
+};
+
 struct EditorConfig {
-	DWORD 	dwOutMode;	// Orignial stdout mode.
-	DWORD	dwInMode;	// Original stdin mode.
-	HANDLE 	hStdin;		// Stdin handle.
-	HANDLE	hStdout;	// Stdout handle.
-	COORD 	bufSize;	// Screen buffer size.
-	COORD	cursor;		// Current cursor position.
-	COORD	rcursor;	// Render cursor position.
-	COORD	offset;		// Editor offset.
+	pos_t 	bufSize;	// Text area size: screen columns, rows minus the two bars.
+	pos_t	cursor;		// Current cursor position.
+	pos_t	rcursor;	// Render cursor position.
+	pos_t	offset;		// Editor offset.
 	int	rx;		// Render X position.
-	line_t	*line;		// Text lines.
+	line_t	*line;		// Text lines, stored as a gap buffer.
 	size_t	linesnum;	// Number of lines.
+	size_t	linecap;	// Allocated line slots, including the gap.
+	size_t	gap;		// First slot of the gap.
+	size_t	hl_valid;	// Highlight frontier: lines above it have a correct hl state.
+	char	*base;		// Original file contents borrowed by mapped lines.
+	size_t	basesize;	// Size of base in bytes.
+	bool	basemapped;	// base is a file mapping, else it is on the heap.
+	fileid_t baseid;	// The file base maps.
 	int	dirty;
 	char	*filename;
 	char	statusmsg[80];
 	time_t	statusmsg_time;
 	struct	EditorSyntax *syntax;
+	mutex_t	lock;		// Guards the lines; the main thread only lets go while waiting for input.
+	cond_t	hl_wake;	// Wakes the highlight worker.
+	thread_t hl_thread;	// Highlight worker.
+	bool	hl_worker;	// Highlight worker running.
+	bool	hl_quit;	// Asks the highlight worker to stop.
+	bool	hl_pending;	// Visible lines were drawn before their highlight was ready.
+	unsigned int hl_gen;	// Bumped whenever highlighting is invalidated.
+	screen_t frame;		// Frame being drawn.
+	screen_t shown;		// Frame last written to the console.
+	pos_t	screen;		// Size of both frames.
+	pos_t	shown_offset;	// Offset the shown frame was drawn at.
+	pos_t	shown_cursor;	// Cursor position on the console.
+	bool	frame_full;	// Next frame is written in full.
+	struct	TerminalBackend *term;	// NULL to only count the bytes of a frame.
+	size_t	frame_bytes;	// Bytes written by the last refresh.
+	double	frame_time;	// When the last frame was drawn.
+	double	time_refresh;	// Seconds spent in EditorRefreshScreen, for benchmarks.
+	double	time_hl;	// Seconds of that spent highlighting.
+	struct	KeyQueue input;	// Keys read ahead of HandleKeyPress.
 };
 
 struct EditorConfig E;
@@ -114,1180 +669,6567 @@ struct EditorSyntax HLDB[] = {
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
+// Every known syntax: the built-in HLDB followed by the definitions loaded
+// from the syntax directory. Extensions are looked up through a hash map.
+struct SyntaxExt {
+	char *ext;
+	struct EditorSyntax *syntax;
+};
+
+struct SyntaxDB {
+	struct EditorSyntax **entries;
+	size_t len;
+	struct SyntaxExt *exts;
+	unsigned int extmask;
+	size_t extlen;
+} SDB;
+
 /*** Prototypes ***/
+linedisp_t *EditorLineRender(line_t *line);
+size_t EditorRenderSize(line_t *line);
+size_t EditorRenderBytes(line_t *line, char *render);
 void EditorSetStatusMessage(const char *fmt, ...);
 void EditorRefreshScreen();
-char *EditorPrompt(char *prompt, void (*callback)(char *, int));
+char *EditorPrompt(char *prompt, void (*callback)(char *, int), bool empty);
+int HandleInputs(void);
+int InitEditorConsole(void);
+void EditorDrawMatches(void);
+int EditorFindStatus(char *buf, size_t size);
+void JournalRecord(int op, int y, int x, const char *s, size_t len);
+
+/*** Profiling ***/
+
+enum PerfStage {
+	PERF_OPEN = 0,
+	PERF_SYNTAX,
+	PERF_DRAW,
+	PERF_FIND,
+	PERF_SAVE,
+	PERF_STAGES
+};
 
-/*** Syntax Highlighting ***/
-int is_separator(int c)
+char *PerfStageNames[] = { "open", "syntax", "draw", "find", "save" };
+
+// Time spent in the main stages of the editor and allocations made by the
+// editing and drawing paths, per frame. Ctrl-P shows them in the message
+// bar; --trace FILE writes them as Chrome trace events.
+struct Perf {
+	double frame[PERF_STAGES];	// Seconds spent in the frame being built.
+	double last[PERF_STAGES];	// Seconds spent in the last frame.
+	double avg[PERF_STAGES];	// Rolling average of last.
+	double run[PERF_STAGES];	// Seconds taken by the latest call.
+	size_t allocs;		// Allocations for the frame being built.
+	size_t last_allocs;	// Allocations for the last frame.
+	bool overlay;		// Timings replace the message bar.
+	FILE *trace;		// Receives trace events, NULL for none.
+	double trace_start;	// Trace timestamps count from here.
+} Perf;
+
+void *PerfMalloc(size_t size)
 {
-	return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+	Perf.allocs++;
+	return malloc(size);
 }
 
-void EditorUpdateSyntax(line_t *line)
+void *PerfRealloc(void *p, size_t size)
 {
-	line->hl = realloc(line->hl, line->rsize);
-	memset(line->hl, HL_NORMAL, line->rsize);
-
-	if (E.syntax == NULL) return;
+	Perf.allocs++;
+	return realloc(p, size);
+}
 
-	char **keywords = E.syntax->keywords;
+// Adds the time since start, taken with ClockNow, to a stage.
+void PerfEnd(int stage, double start)
+{
+	double now = ClockNow();
+
+	Perf.frame[stage] += now - start;
+	Perf.run[stage] = now - start;
+	// Syntax is timed per line, so the trace only gets its total per frame.
+	if (Perf.trace && stage != PERF_SYNTAX)
+		fprintf(Perf.trace, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.1f,\"dur\":%.1f}",
+			PerfStageNames[stage], (start - Perf.trace_start) * 1e6, (now - start) * 1e6);
+}
 
-	char *scs = E.syntax->singleline_comment_start;
-	char *mcs = E.syntax->multiline_comment_start;
-	char *mce = E.syntax->multiline_comment_end;
+// Closes the frame being built, after it has been written.
+void PerfFrame(void)
+{
+	int i;
 
-	int scs_len = scs ? strlen(scs) : 0;
-	int mcs_len = scs ? strlen(mcs) : 0;
-	int mce_len = scs ? strlen(mce) : 0;
+	if (Perf.trace)
+		fprintf(Perf.trace, ",\n{\"name\":\"frame\",\"ph\":\"C\",\"pid\":1,\"tid\":1,\"ts\":%.1f,"
+			"\"args\":{\"syntax_us\":%.1f,\"allocs\":%zu,\"bytes\":%zu}}",
+			(ClockNow() - Perf.trace_start) * 1e6, Perf.frame[PERF_SYNTAX] * 1e6, Perf.allocs, E.frame_bytes);
+	for (i = 0; i < PERF_STAGES; i++)
+	{
+		Perf.last[i] = Perf.frame[i];
+		Perf.avg[i] += (Perf.frame[i] - Perf.avg[i]) / KILO_PERF_AVERAGE;
+		Perf.frame[i] = 0;
+	}
+	Perf.last_allocs = Perf.allocs;
+	Perf.allocs = 0;
+}
 
-	int prev_sep = 1;
-	int in_string = 0;
-	int in_comment = (line->idx > 0 && E.line[line->idx - 1].hl_open_comment);
+// Formats the overlay: last frame and average milliseconds for the stages
+// run every frame, then the latest save and open.
+int PerfOverlay(char *buf, size_t size)
+{
+	int len = snprintf(buf, size,
+		"draw %.2f/%.2f hl %.2f/%.2f find %.2f/%.2f ms %zu allocs %zu B save %.1f open %.1f ms",
+		Perf.last[PERF_DRAW] * 1e3, Perf.avg[PERF_DRAW] * 1e3,
+		Perf.last[PERF_SYNTAX] * 1e3, Perf.avg[PERF_SYNTAX] * 1e3,
+		Perf.last[PERF_FIND] * 1e3, Perf.avg[PERF_FIND] * 1e3,
+		Perf.last_allocs, E.frame_bytes,
+		Perf.run[PERF_SAVE] * 1e3, Perf.run[PERF_OPEN] * 1e3);
+	return (len < (int)size) ? len : (int)size - 1;
+}
 
-	int i = 0;
-	while (i < line->rsize)
+int PerfTraceOpen(char *filename)
+{
+	Perf.trace = fopen(filename, "w");
+	if (Perf.trace == NULL)
 	{
-		char c = line->render[i];
-		unsigned char prev_hl = (i > 0) ? line->hl[i - 1] : HL_NORMAL;
+		fprintf(stderr, "Can't open %s: %s\n", filename, strerror(errno));
+		return 0;
+	}
+	Perf.trace_start = ClockNow();
+	fprintf(Perf.trace, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"winkilo\"}}");
+	return 1;
+}
 
-		if (scs_len && !in_string && !in_comment)
-		{
-			if (!strncmp(&line->render[i], scs, scs_len))
-			{
-				memset(&line->hl[i], HL_COMMENT, line->rsize - i);
-				break;
-			}
-		}
+void PerfTraceClose(void)
+{
+	if (Perf.trace == NULL) return;
+	fprintf(Perf.trace, "\n]\n");
+	fclose(Perf.trace);
+	Perf.trace = NULL;
+}
 
-		if (mcs_len && mce_len && !in_string)
-		{
-			if (in_comment)
-			{
-				line->hl[i] = HL_MLCOMMENT;
-				if (!strncmp(&line->render[i], mce, mce_len))
-				{
-					memset(&line->hl[i], HL_MLCOMMENT, mce_len);
-					i += mce_len;
-					in_comment = 0;
-					prev_sep = 1;
-					continue;
-				}
-				else
-				{
-					i++;
-					continue;
-				}
-			}
-			else if (!strncmp(&line->render[i], mcs, mcs_len))
-			{
-				memset(&line->hl[i], HL_MLCOMMENT, mcs_len);
-				i += mcs_len;
-				in_comment = 1;
-				continue;
-			}
-		}
+/*** Line Storage ***/
 
-		if (E.syntax->flags & HL_HIGHLIGHT_STRINGS)
-		{
-			if (in_string)
-			{
-				line->hl[i] = HL_STRING;
-				if (c == '\\' && i + 1 < line->rsize)
-				{
-					line->hl[i + 1] = HL_STRING;
-					i += 2;
-					continue;
-				}
-				if (c == in_string) in_string = 0;
-				i++;
-				prev_sep = 1;
-				continue;
-			}
-			else
-			{
-				if (c == '"' || c == '\'')
-				{
-					in_string = c;
-					line->hl[i] = HL_STRING;
-					i++;
-					continue;
-				}
-			}
-		}
+// Lines live in a gap buffer: slots [0, gap) hold the lines before the gap
+// and the last (linesnum - gap) slots hold the rest. Inserting or deleting
+// lines only moves the lines between the old and the new edit point, so
+// editing stays cheap regardless of the file size.
+line_t *EditorLine(size_t at)
+{
+	return &E.line[at < E.gap ? at : at + (E.linecap - E.linesnum)];
+}
 
-		if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS)
-		{
-			if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER))
-			{
-				line->hl[i] = HL_NUMBER;
-				i++;
-				prev_sep = 0;
-				continue;
-			}
-		}
+void EditorMoveGap(size_t at)
+{
+	size_t gaplen = E.linecap - E.linesnum;
 
-		if (prev_sep)
-		{
-			int j;
-			for (j = 0; keywords[j]; j++)
-			{
-				int klen = strlen(keywords[j]);
-				int kw2 = keywords[j][klen - 1] == '|';
-				if (kw2) klen--;
+	if (at < E.gap)
+		memmove(&E.line[at + gaplen], &E.line[at], sizeof(line_t) * (E.gap - at));
+	else if (at > E.gap)
+		memmove(&E.line[E.gap], &E.line[E.gap + gaplen], sizeof(line_t) * (at - E.gap));
+	E.gap = at;
+}
 
-				if (!strncmp(&line->render[i], keywords[j], klen) && is_separator(line->render[i + klen]))
-				{
-					memset(&line->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-					i += klen;
-				}
-			}
+void EditorGrowLines(size_t need)
+{
+	if (E.linecap - E.linesnum >= need) return;
 
-			if (keywords[j] != NULL)
-			{
-				prev_sep = 0;
-				continue;
-			}
-		}
+	size_t newcap = E.linecap ? E.linecap : 64;
+	while (newcap - E.linesnum < need)
+		newcap *= 2;
 
-		prev_sep = is_separator(c);
-		i++;
+	line_t *new = PerfRealloc(E.line, sizeof(line_t) * newcap);
+	if (new == NULL)
+	{
+		perror("Line Storage: ");
+		exit(1);
 	}
 
-	int changed = (line->hl_open_comment != in_comment);
-	line->hl_open_comment = in_comment;
-	if (changed && line->idx + 1 < E.linesnum)
-		EditorUpdateSyntax(&E.line[line->idx + 1]);
+	size_t tail = E.linesnum - E.gap;
+	memmove(&new[newcap - tail], &new[E.linecap - tail], sizeof(line_t) * tail);
+	E.line = new;
+	E.linecap = newcap;
 }
 
-int EditorSyntaxToColor(int hl)
+// The bytes of edited lines come in chunks of a power of two from 16 to
+// KILO_SLAB_MAX bytes, cut from slabs of KILO_SLAB_SIZE, which spares a
+// malloc and its overhead per line. Freed chunks are kept on a list per
+// size. A line always sits in the smallest chunk holding its bytes and
+// a NUL, so its chunk is known from its size.
+struct Slab {
+	char *next;	// Unused part of the newest slab.
+	size_t left;
+	char *free[9];	// Freed chunks of 16 << i bytes, each holding the next.
+} Slab;
+
+// Chunk size index for n bytes, -1 when they go to malloc.
+int SlabClass(size_t n)
 {
-	switch(hl)
-	{
-		case HL_COMMENT:
-		case HL_MLCOMMENT: return 36;
-		case HL_KEYWORD1: return 33;
-		case HL_KEYWORD2: return 32;
-		case HL_STRING: return 35;
-		case HL_NUMBER: return 31;
-		case HL_MATCH: return 34;
-		default: return 37;
-	}
+	int c = 0;
+
+	if (n > KILO_SLAB_MAX) return -1;
+	while ((size_t)16 << c < n)
+		c++;
+	return c;
 }
 
-void EditorSelectSyntaxHighlight()
+char *LineAlloc(size_t n)
 {
-	E.syntax = NULL;
-	if (E.filename == NULL) return;
-
-	char *ext = strrchr(E.filename, '.');
+	int c = SlabClass(n);
+	if (c < 0) return PerfMalloc(n);
 
-	for (unsigned int j = 0; j < HLDB_ENTRIES; j++)
+	char *p = Slab.free[c];
+	if (p != NULL)
+	{
+		memcpy(&Slab.free[c], p, sizeof(p));
+		return p;
+	}
+	size_t chunk = (size_t)16 << c;
+	if (Slab.left < chunk)
 	{
-		struct EditorSyntax *s = &HLDB[j];
-		unsigned int i = 0;
-		while (s->filematch[i])
+		Slab.next = PerfMalloc(KILO_SLAB_SIZE);
+		if (Slab.next == NULL)
 		{
-			int is_ext = (s->filematch[i][0] == '.');
-			if ((is_ext && ext && !strcmp(ext, s->filematch[i])) || (!is_ext && strstr(E.filename, s->filematch[i])))
-			{
-				E.syntax = s;
-
-				int filerow;
-				for (filerow = 0; filerow < E.linesnum; filerow++)
-				{
-					EditorUpdateSyntax(&E.line[filerow]);
-				}
-				return;
-			}
-			i++;
+			perror("Line Storage: ");
+			exit(1);
 		}
+		Slab.left = KILO_SLAB_SIZE;
 	}
+	p = Slab.next;
+	Slab.next += chunk;
+	Slab.left -= chunk;
+	return p;
 }
 
-/*** Line Operations ***/
-int EditorLineCxToRx(line_t *line, int cx)
+void LineFree(char *p, size_t n)
 {
-	int j, rx = 0;
-	for (j = 0; j < cx; j++)
+	int c = SlabClass(n);
+	if (c < 0)
 	{
-		if (line->bytes[j] == '\t')
-			rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-		rx++;
+		free(p);
+		return;
 	}
-
-	return rx;
+	memcpy(p, &Slab.free[c], sizeof(p));
+	Slab.free[c] = p;
 }
 
-int EditorLineRxToCx(line_t *line, int rx)
+// Moves p, allocated for n bytes, to a chunk for size bytes when it needs
+// another one.
+char *LineResize(char *p, size_t n, size_t size)
 {
-	int cx, cur_rx = 0;
-	for (cx = 0; cx < line->size; cx++)
-	{
-		if (line->bytes[cx] == '\t')
-			cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
-		cur_rx++;
+	int from = SlabClass(n), to = SlabClass(size);
 
-		if (cur_rx > rx) return cx;
-	}
+	if (from >= 0 && from == to) return p;
+	if (from < 0 && to < 0) return PerfRealloc(p, size);
 
-	return cx;
+	char *q = LineAlloc(size);
+	memcpy(q, p, n < size ? n : size);
+	LineFree(p, n);
+	return q;
 }
 
-void EditorUpdateLine(line_t *line)
+// Render and hl of the KILO_DISP_CACHE lines drawn last, so only about a
+// screen of them is kept whatever the file size. Entries are found by the
+// disp key of their line, which a line gets when first drawn and loses when
+// its bytes change, and are reused least recently used first. Entry 0 is
+// the head of the use list and never holds a line.
+struct Displays {
+	linedisp_t *entry;
+	uint32_t *bucket;	// Hash of keys to entries, 2 * KILO_DISP_CACHE of them.
+	uint32_t key;		// Last key given out.
+} Displays;
+
+void DisplaysUnlink(uint32_t i)
 {
-	int j,
-		idx = 0,
-		tabs = 0;
+	linedisp_t *d = &Displays.entry[i];
+	Displays.entry[d->prev].next = d->next;
+	Displays.entry[d->next].prev = d->prev;
+}
 
-	for (j = 0; j < line->size; j++)
-		if (line->bytes[j] == '\t')
-			tabs++;
+// Links entry i as the most recently used one, or the least with last.
+void DisplaysLink(uint32_t i, bool last)
+{
+	linedisp_t *d = &Displays.entry[i];
+	d->prev = last ? Displays.entry[0].prev : 0;
+	d->next = Displays.entry[d->prev].next;
+	Displays.entry[d->prev].next = i;
+	Displays.entry[d->next].prev = i;
+}
 
-	free(line->render);
-	line->render = malloc(line->size + tabs * (KILO_TAB_STOP - 1) + 1);
+// Takes the entry of key out of the hash.
+void DisplaysUnhash(uint32_t key)
+{
+	uint32_t *p = &Displays.bucket[key & (2 * KILO_DISP_CACHE - 1)];
 
-	for (j = 0; j < line->size; j++)
+	while (*p && Displays.entry[*p].key != key)
+		p = &Displays.entry[*p].hnext;
+	if (*p)
 	{
-		if (line->bytes[j] == '\t')
-		{
-			line->render[idx++] = ' ';
-			while (idx % KILO_TAB_STOP != 0)
-				line->render[idx++] = ' ';
-		}
-		else
-		{
-			line->render[idx++] = line->bytes[j];
-		}
+		linedisp_t *d = &Displays.entry[*p];
+		*p = d->hnext;
+		d->key = 0;
 	}
-	line->render[idx] = '\0';
-	line->rsize = idx;
-
-	EditorUpdateSyntax(line);
 }
 
-void EditorInsertLine(int at, char *s, size_t len)
+void DisplaysInit(void)
 {
-	if (at < 0 || at > E.linesnum) return;
-
-	E.line = realloc(E.line, sizeof(line_t) * (E.linesnum + 1));
-	memmove(&E.line[at + 1], &E.line[at], sizeof(line_t) * (E.linesnum - at));
-	for (int j = at + 1; j <= E.linesnum; j++) E.line[j].idx++;
+	Displays.entry = calloc(KILO_DISP_CACHE + 1, sizeof(linedisp_t));
+	Displays.bucket = calloc(2 * KILO_DISP_CACHE, sizeof(uint32_t));
+	if (Displays.entry == NULL || Displays.bucket == NULL)
+	{
+		perror("Line Storage: ");
+		exit(1);
+	}
+	for (uint32_t i = 1; i <= KILO_DISP_CACHE; i++)
+		DisplaysLink(i, true);
+}
 
-	E.line[at].idx = at;
+// The cached display of line, NULL when it has none.
+linedisp_t *EditorLineDisp(line_t *line)
+{
+	if (!line->disp || Displays.entry == NULL) return NULL;
 
-	E.line[at].size = len;
-	E.line[at].bytes = malloc(len + 1);
-	memcpy(E.line[at].bytes, s, len);
-	E.line[at].bytes[len] = '\0';
-	E.line[at].render = NULL;
-	E.line[at].rsize = 0;
-	E.line[at].hl = NULL;
-	E.line[at].hl_open_comment = 0;
-	EditorUpdateLine(&E.line[at]);
+	uint32_t i = Displays.bucket[line->disp & (2 * KILO_DISP_CACHE - 1)];
+	while (i && Displays.entry[i].key != line->disp)
+		i = Displays.entry[i].hnext;
+	if (!i) return NULL;
 
-	E.linesnum++;
-	E.dirty++;
+	DisplaysUnlink(i);
+	DisplaysLink(i, false);
+	return &Displays.entry[i];
 }
 
-void EditorFreeLine(line_t *line)
+// Gives line an empty display, reusing the least recently used one.
+linedisp_t *EditorLineDispNew(line_t *line)
 {
-	free(line->render);
-	free(line->bytes);
-	free(line->hl);
-}
+	if (Displays.entry == NULL)
+		DisplaysInit();
+	if (!line->disp)
+	{
+		// Keys ran out: no line keeps one, so they can start over.
+		if (Displays.key == (1 << 28) - 1)
+		{
+			for (size_t j = 0; j < E.linesnum; j++)
+				EditorLine(j)->disp = 0;
+			for (uint32_t i = 1; i <= KILO_DISP_CACHE; i++)
+				if (Displays.entry[i].key)
+					DisplaysUnhash(Displays.entry[i].key);
+			Displays.key = 0;
+		}
+		line->disp = ++Displays.key;
+	}
 
-void EditorDelLine(int at)
-{
-	if (at < 0 || at >= E.linesnum) return;
-	EditorFreeLine(&E.line[at]);
-	memmove(&E.line[at], &E.line[at + 1], sizeof(line_t) * (E.linesnum - at - 1));
-	for (int j = at; j <= E.linesnum - 1; j++) E.line[j].idx--;
-	E.linesnum--;
-	E.dirty++;
+	uint32_t i = Displays.entry[0].prev;
+	linedisp_t *d = &Displays.entry[i];
+	if (d->key)
+		DisplaysUnhash(d->key);
+	// Buffers of long lines aren't kept for the next one.
+	if (d->rcap > KILO_SLAB_MAX)
+	{
+		free(d->render);
+		d->render = NULL;
+		d->rcap = 0;
+	}
+	if (d->hlcap > KILO_SLAB_MAX)
+	{
+		free(d->hl);
+		d->hl = NULL;
+		d->hlcap = 0;
+	}
+	d->key = line->disp;
+	d->hnext = Displays.bucket[d->key & (2 * KILO_DISP_CACHE - 1)];
+	Displays.bucket[d->key & (2 * KILO_DISP_CACHE - 1)] = i;
+	d->rsize = 0;
+	d->hlruns = 0;
+	d->tabs = false;
+	d->entry = -1;
+	DisplaysUnlink(i);
+	DisplaysLink(i, false);
+	return d;
 }
 
-void EditorLineInsertChar(line_t *line, int at, int c)
+// Drops the cached display of a line, to be built again when it is drawn.
+void EditorLineDispFree(line_t *line)
 {
-	if (at < 0 || at > line->size)
-		at = line->size;
-	line->bytes = realloc(line->bytes, line->size + 2);
-	memmove(&line->bytes[at + 1], &line->bytes[at], line->size - at + 1);
-	line->size++;
-	line->bytes[at] = c;
-	EditorUpdateLine(line);
-	E.dirty++;
-}
+	if (!line->disp) return;
 
-void EditorLineAppendString(line_t *line, char *s, size_t len)
-{
-	line->bytes = realloc(line->bytes, line->size + len + 1);
-	memcpy(&line->bytes[line->size], s, len);
-	line->size += len;
-	line->bytes[line->size] = '\0';
-	EditorUpdateLine(line);
-	E.dirty++;
+	linedisp_t *d = EditorLineDisp(line);
+	if (d)
+	{
+		DisplaysUnhash(d->key);
+		DisplaysUnlink(d - Displays.entry);
+		DisplaysLink(d - Displays.entry, true);
+	}
+	line->disp = 0;
 }
 
-void EditorLineDelChar(line_t *line, int at)
+// Text a line is drawn from, d->rsize bytes.
+char *EditorDispText(line_t *line, linedisp_t *d)
 {
-	if (at < 0 || at >= line->size) return;
-	memmove(&line->bytes[at], &line->bytes[at + 1], line->size - at);
-	line->size--;
-	EditorUpdateLine(line);
-	E.dirty++;
+	return d->tabs ? d->render : line->bytes;
 }
 
-/*** Editor Operations ***/
-void EditorInsertChar(int c)
+/*** Keywords ***/
+
+// Keywords of a syntax compiled into an open addressing hash table. The
+// hash seed is searched at compile time until every keyword lands in its
+// home slot, which makes a lookup a single hash of the token and at most
+// one compare. Tables that find no such seed fall back to linear probing.
+struct Keyword {
+	const char *word;
+	unsigned int len;
+	unsigned char hl;
+};
+
+struct KeywordTable {
+	struct Keyword *slots;
+	unsigned int mask;
+	uint32_t seed;
+	uint64_t lens;		// Bit n set when some keyword is n bytes long (n < 64).
+};
+
+#define KEYWORD_SEED_TRIES 256
+
+uint32_t KeywordHash(uint32_t seed, const char *s, size_t len)
 {
-	if (E.cursor.Y == E.linesnum)
+	uint32_t h = 2166136261u ^ seed;
+	for (size_t j = 0; j < len; j++)
 	{
-		EditorInsertLine(E.linesnum, "", 0);
+		h ^= (unsigned char)s[j];
+		h *= 16777619u;
 	}
-	EditorLineInsertChar(&E.line[E.cursor.Y], E.cursor.X, c);
-	E.cursor.X++;
+	return h ^ (h >> 15);
 }
 
-void EditorInsertNewLine(void)
+// Fills kt with the keywords using seed. Returns how many keywords did not
+// land in their home slot.
+int KeywordTableFill(struct KeywordTable *kt, char **keywords, uint32_t seed)
 {
-	if (E.cursor.X == 0)
-	{
-		EditorInsertLine(E.cursor.Y, "", 0);
-	}
-	else
+	int displaced = 0;
+
+	memset(kt->slots, 0, sizeof(struct Keyword) * (kt->mask + 1));
+	kt->seed = seed;
+	for (int j = 0; keywords[j]; j++)
 	{
-		line_t *line = &E.line[E.cursor.Y];
-		EditorInsertLine(E.cursor.Y + 1, &line->bytes[E.cursor.X], line->size - E.cursor.X);
-		line = &E.line[E.cursor.Y];
-		line->size = E.cursor.X;
-		line->bytes[line->size] = '\0';
-		EditorUpdateLine(line);
+		size_t len = strlen(keywords[j]);
+		int kw2 = keywords[j][len - 1] == '|';
+		if (kw2) len--;
+
+		unsigned int slot = KeywordHash(seed, keywords[j], len) & kt->mask;
+		if (kt->slots[slot].word != NULL)
+			displaced++;
+		while (kt->slots[slot].word != NULL)
+			slot = (slot + 1) & kt->mask;
+
+		kt->slots[slot].word = keywords[j];
+		kt->slots[slot].len = len;
+		kt->slots[slot].hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
 	}
-	E.cursor.X = 0;
-	E.cursor.Y++;
+	return displaced;
 }
 
-void EditorDelChar(void)
+struct KeywordTable *KeywordTableCompile(char **keywords)
 {
-	if (E.cursor.Y == E.linesnum) return;
-	if (E.cursor.X == 0 && E.cursor.Y == 0) return;
+	struct KeywordTable *kt = calloc(1, sizeof(*kt));
+	unsigned int n = 0, size = 4;
+	int j;
 
-	line_t *line = &E.line[E.cursor.Y];
-	if (E.cursor.X > 0)
+	for (j = 0; keywords[j]; j++, n++)
 	{
-		EditorLineDelChar(line, E.cursor.X - 1);
-		E.cursor.X--;
+		size_t len = strlen(keywords[j]);
+		if (keywords[j][len - 1] == '|') len--;
+		if (len < 64)
+			kt->lens |= (uint64_t)1 << len;
+		else
+			kt->lens |= (uint64_t)1 << 63;
 	}
-	else
+
+	// A table four times larger than the keyword count usually admits a
+	// collision free seed within a few tries.
+	while (size < n * 4)
+		size *= 2;
+	kt->mask = size - 1;
+	kt->slots = malloc(sizeof(struct Keyword) * size);
+
+	uint32_t best = 0;
+	int fewest = n + 1;
+	for (uint32_t seed = 0; seed < KEYWORD_SEED_TRIES && fewest > 0; seed++)
 	{
-		E.cursor.X = E.line[E.cursor.Y - 1].size;
-		EditorLineAppendString(&E.line[E.cursor.Y - 1], line->bytes, line->size);
-		EditorDelLine(E.cursor.Y);
-		E.cursor.Y--;
+		int displaced = KeywordTableFill(kt, keywords, seed);
+		if (displaced < fewest)
+		{
+			fewest = displaced;
+			best = seed;
+		}
 	}
+	KeywordTableFill(kt, keywords, best);
+	return kt;
 }
 
-/*** File I/O ***/
-char *EditorLinesToString(int *buflen)
+// Returns HL_KEYWORD1 or HL_KEYWORD2 when the token is a keyword,
+// HL_NORMAL otherwise.
+int KeywordLookup(struct KeywordTable *kt, const char *s, size_t len)
 {
-	int j, totlen = 0;
-	for (j = 0; j < E.linesnum; ++j)
-		totlen += E.line[j].size + 1;
-	*buflen = totlen;
+	if (kt == NULL || len == 0) return HL_NORMAL;
+	if (!(kt->lens & ((uint64_t)1 << (len < 64 ? len : 63)))) return HL_NORMAL;
 
-	char *buf = malloc(totlen);
-	char *p = buf;
-	for (j = 0; j < E.linesnum; ++j)
+	unsigned int slot = KeywordHash(kt->seed, s, len) & kt->mask;
+	while (kt->slots[slot].word != NULL)
 	{
-		memcpy(p, E.line[j].bytes, E.line[j].size);
-		p += E.line[j].size;
-		*p = '\n';
-		p++;
+		if (kt->slots[slot].len == len && !memcmp(kt->slots[slot].word, s, len))
+			return kt->slots[slot].hl;
+		slot = (slot + 1) & kt->mask;
 	}
-	p--;
-	*p = '\0';
-
-	return buf;
+	return HL_NORMAL;
 }
 
-void EditorOpen(char *filename)
+/*** Syntax Highlighting ***/
+// Fills in the byte class table and keyword table of a syntax. Every
+// character test in the highlighter loop is a single lookup in the class
+// table; multi-byte delimiters are only compared where their first byte is.
+void EditorSyntaxCompile(struct EditorSyntax *s)
 {
-	free(E.filename);
-	E.filename = strdup(filename);
+	if (s->classes != NULL) return;
 
-	EditorSelectSyntaxHighlight();
+	unsigned char *cls = calloc(256, 1);
+	char *sep = s->separators ? s->separators : KILO_SEPARATORS;
+	char *quotes = s->quotes ? s->quotes : "\"'";
+	char *numbers = s->number_chars ? s->number_chars : ".";
+	int c;
 
-	FILE *fp = fopen(filename, "r");
-	if (!fp)
+	for (c = 0; c < 256; c++)
 	{
-		perror("File Open: ");
-		getchar();
-		exit(1);
+		if (c == '\0' || isspace(c) || strchr(sep, c) != NULL)
+			cls[c] |= CLS_SEP;
+		if (isdigit(c))
+			cls[c] |= CLS_DIGIT;
 	}
+	for (; *numbers; numbers++)
+		cls[(unsigned char)*numbers] |= CLS_NUMBER;
+	for (; *quotes; quotes++)
+		cls[(unsigned char)*quotes] |= CLS_QUOTE;
+	if (s->singleline_comment_start && s->singleline_comment_start[0])
+		cls[(unsigned char)s->singleline_comment_start[0]] |= CLS_SCS;
+	if (s->multiline_comment_start && s->multiline_comment_start[0])
+		cls[(unsigned char)s->multiline_comment_start[0]] |= CLS_MCS;
+	if (s->multiline_comment_end && s->multiline_comment_end[0])
+		cls[(unsigned char)s->multiline_comment_end[0]] |= CLS_MCE;
+
+	s->kwtable = KeywordTableCompile(s->keywords);
+	s->classes = cls;
+}
 
-	char buf[64];
-	char *line = NULL;
-	size_t nread;
-	size_t linelen = 0;
-	size_t linecap = 0;
-	bool newline = false;
+// Highlights one rendered line into hl, starting in a multiline comment when
+// in_comment is set. Returns whether a multiline comment is still open at
+// the end of the line. render needn't be NUL terminated. Only reads its
+// arguments, so the worker can call it without holding the lock. The syntax
+// must have been compiled.
+int EditorHighlight(struct EditorSyntax *syntax, char *render, size_t rsize, unsigned char *hl, int in_comment)
+{
+	memset(hl, HL_NORMAL, rsize);
 
-	while (fgets(buf, sizeof(buf), fp) != NULL)
+	if (syntax == NULL) return 0;
+
+	const unsigned char *cls = syntax->classes;
+
+	char *scs = syntax->singleline_comment_start;
+	char *mcs = syntax->multiline_comment_start;
+	char *mce = syntax->multiline_comment_end;
+
+	int scs_len = scs ? strlen(scs) : 0;
+	int mcs_len = mcs ? strlen(mcs) : 0;
+	int mce_len = mce ? strlen(mce) : 0;
+
+	int prev_sep = 1;
+	int in_string = 0;
+
+	int i = 0;
+	while (i < rsize)
 	{
-		nread = strlen(buf);
-		while (nread > 0 && (buf[nread - 1] == '\n' || buf[nread - 1] == '\r'))
+		char c = render[i];
+		unsigned char k = cls[(unsigned char)c];
+		unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
+
+		if ((k & CLS_SCS) && !in_string && !in_comment)
 		{
-			nread--;
-			newline = true;
+			if (i + scs_len <= rsize && !memcmp(&render[i], scs, scs_len))
+			{
+				memset(&hl[i], HL_COMMENT, rsize - i);
+				break;
+			}
 		}
 
-		if (linecap < linelen + nread)
+		if (mcs_len && mce_len && !in_string)
 		{
-			line = realloc(line, linelen + nread);
-			linecap = linelen + nread;
+			if (in_comment)
+			{
+				hl[i] = HL_MLCOMMENT;
+				if ((k & CLS_MCE) && i + mce_len <= rsize && !memcmp(&render[i], mce, mce_len))
+				{
+					memset(&hl[i], HL_MLCOMMENT, mce_len);
+					i += mce_len;
+					in_comment = 0;
+					prev_sep = 1;
+					continue;
+				}
+				else
+				{
+					i++;
+					continue;
+				}
+			}
+			else if ((k & CLS_MCS) && i + mcs_len <= rsize && !memcmp(&render[i], mcs, mcs_len))
+			{
+				memset(&hl[i], HL_MLCOMMENT, mcs_len);
+				i += mcs_len;
+				in_comment = 1;
+				continue;
+			}
 		}
 
-		memcpy(&line[linelen], buf, nread);
-		linelen += nread;
-
-		if (newline)
+		if (syntax->flags & HL_HIGHLIGHT_STRINGS)
 		{
-			EditorInsertLine(E.linesnum, line, linelen);
-			newline = false;
-			linelen = 0;
+			if (in_string)
+			{
+				hl[i] = HL_STRING;
+				if (c == '\\' && i + 1 < rsize)
+				{
+					hl[i + 1] = HL_STRING;
+					i += 2;
+					continue;
+				}
+				if (c == in_string) in_string = 0;
+				i++;
+				prev_sep = 1;
+				continue;
+			}
+			else
+			{
+				if (k & CLS_QUOTE)
+				{
+					in_string = c;
+					hl[i] = HL_STRING;
+					i++;
+					continue;
+				}
+			}
 		}
-	}
-	
-	EditorInsertLine(E.linesnum, line, linelen);
-	free(line);
-	fclose(fp);
-	E.dirty = 0;
-}
 
-void EditorSave(void)
-{
-	if (E.filename == NULL)
-	{
-		E.filename = EditorPrompt("Save as: %s (ESC to cancel)", NULL);
-		if (E.filename == NULL)
+		if (syntax->flags & HL_HIGHLIGHT_NUMBERS)
 		{
-			EditorSetStatusMessage("Save aborted");
-			return;
+			if (((k & CLS_DIGIT) && (prev_sep || prev_hl == HL_NUMBER)) || ((k & CLS_NUMBER) && prev_hl == HL_NUMBER))
+			{
+				hl[i] = HL_NUMBER;
+				i++;
+				prev_sep = 0;
+				continue;
+			}
 		}
-		EditorSelectSyntaxHighlight();
-	}
 
-	int len;
-	char *buf = EditorLinesToString(&len);
-
-	FILE *fp = fopen(E.filename, "w+");
-	if (fp != NULL)
-	{
-		if (fwrite(buf, 1, len, fp) == len)
+		if (prev_sep)
 		{
-			fclose(fp);
-			free(buf);
-			E.dirty = 0;
-			EditorSetStatusMessage("%d bytes written to disk", len);
-			return;
+			size_t klen = 0;
+			while (i + klen < rsize && !(cls[(unsigned char)render[i + klen]] & CLS_SEP))
+				klen++;
+
+			int kw = KeywordLookup(syntax->kwtable, &render[i], klen);
+			if (kw != HL_NORMAL)
+			{
+				memset(&hl[i], kw, klen);
+				i += klen;
+				prev_sep = 0;
+				continue;
+			}
 		}
-		fclose(fp);
+
+		prev_sep = k & CLS_SEP;
+		i++;
 	}
-	free(buf);
-	EditorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));	
+
+	return in_comment;
 }
 
-/*** Find ***/
-void EditorFindCallback(char *query, int key)
+// Multiline comment state at the start of line at. Only meaningful for
+// lines below the highlight frontier.
+int EditorSyntaxEntry(int at)
 {
-	static int last_match = -1;
-	static int direction = 1;
-
-	static int saved_hl_line;
-	static char *saved_hl = NULL;
+	return at > 0 && EditorLine(at - 1)->hl_open_comment;
+}
 
-	if (saved_hl)
-	{
-		memcpy(E.line[saved_hl_line].hl, saved_hl, E.line[saved_hl_line].rsize);
-		free(saved_hl);
-		saved_hl = NULL;
-	}
+// Keeps the n bytes of hl in d as runs.
+void EditorHlEncode(linedisp_t *d, const unsigned char *hl, size_t n)
+{
+	size_t runs = 0, i, j;
 
-	if (key == '\r' || key == '\x1b')
+	for (i = 0; i < n; i = j)
 	{
-		last_match = -1;
-		direction = 1;
-		return;
+		for (j = i + 1; j < n && j - i < 255 && hl[j] == hl[i]; j++)
+			;
+		runs++;
 	}
-	else if (key == ARROW_RIGHT || key == ARROW_DOWN)
+	if (runs * 2 > d->hlcap)
 	{
-		direction = 1;
+		unsigned char *p = PerfRealloc(d->hl, runs * 2);
+		if (p == NULL)
+			return;
+		d->hl = p;
+		d->hlcap = runs * 2;
 	}
-	else if (key == ARROW_LEFT || key == ARROW_UP)
+	unsigned char *p = d->hl;
+	d->hlruns = runs;
+	for (i = 0; i < n; i = j)
 	{
-		direction = -1;
+		for (j = i + 1; j < n && j - i < 255 && hl[j] == hl[i]; j++)
+			;
+		*p++ = j - i;
+		*p++ = hl[i];
 	}
-	else
+}
+
+// Rebuilds hl for a line below the highlight frontier.
+void EditorUpdateSyntax(int at)
+{
+	static unsigned char *hl = NULL;
+	static size_t cap = 0;
+	double t = ClockNow();
+	line_t *line = EditorLine(at);
+	linedisp_t *d = EditorLineRender(line);
+	int entry = EditorSyntaxEntry(at);
+
+	if (d->rsize >= cap)
 	{
-		last_match = -1;
-		direction = 1;
+		cap = d->rsize * 2 + 1;
+		hl = PerfRealloc(hl, cap);
 	}
+	line->hl_open_comment = EditorHighlight(E.syntax, EditorDispText(line, d), d->rsize, hl, entry);
+	line->hl_entry = entry;
+	EditorHlEncode(d, hl, d->rsize);
+	d->entry = entry;
+	PerfEnd(PERF_SYNTAX, t);
+}
 
-	if (last_match == -1)
-		direction = 1;
-
-	int current = last_match;
-	int i;
-	for (i = 0; i < E.linesnum; ++i)
-	{
-		current += direction;
-		if (current == -1)
-			current = E.linesnum - 1;
-		else if (current == E.linesnum)
-			current = 0;
-
-		line_t *line = &E.line[current];
-		char *match = strstr(line->render, query);
-		if (match)
-		{
-			last_match = current;
-			E.cursor.Y = current;
-			E.offset.Y = E.linesnum;
-			E.cursor.X = EditorLineRxToCx(line, match - line->render);
-			saved_hl_line = current;
-			saved_hl = malloc(line->rsize);
-			memcpy(saved_hl, line->hl, line->rsize);
-			memset(&line->hl[match - line->render], HL_MATCH, strlen(query));
-			break;
-		}
-	}
+// Called whenever line at changes: the highlight state of every line from
+// here down has to be recomputed before it is trusted again.
+void EditorInvalidateSyntax(int at)
+{
+	if (at < E.hl_valid)
+		E.hl_valid = at;
+	E.hl_gen++;
 }
 
-void EditorFind(void)
+// Advances the highlight frontier so lines [0, upto) have a correct comment
+// state. Lines whose bytes and entry state are unchanged are skipped, lines
+// without a cached display are highlighted into scratch space just for their
+// state. Nothing below upto is touched, so an edit costs at most the lines
+// between it and the bottom of the screen.
+void EditorSyntaxCatchUp(int upto)
 {
-	COORD saved_cursor = E.cursor;
-	COORD saved_offset = E.offset;
+	static char *render = NULL;
+	static unsigned char *hl = NULL;
+	static size_t cap = 0;
 
-	char *query = EditorPrompt("Search: %s (use Arrows, ESC or Enter)", EditorFindCallback);
-	
-	if (query)
+	if (upto > E.linesnum) upto = E.linesnum;
+
+	for (; E.hl_valid < upto; E.hl_valid++)
 	{
-		free(query);
-	}
+		int at = E.hl_valid;
+		line_t *line = EditorLine(at);
+		int entry = EditorSyntaxEntry(at);
+
+		if (line->hl_entry == entry) continue;
+
+		if (EditorLineDisp(line))
+		{
+			EditorUpdateSyntax(at);
+			continue;
+		}
+
+		bool tabs = memchr(line->bytes, '\t', line->size) != NULL;
+		size_t need = tabs ? EditorRenderSize(line) : line->size + 1;
+		if (need > cap)
+		{
+			cap = need * 2;
+			render = PerfRealloc(render, cap);
+			hl = PerfRealloc(hl, cap);
+		}
+		char *text = line->bytes;
+		size_t rsize = line->size;
+		if (tabs)
+		{
+			rsize = EditorRenderBytes(line, render);
+			text = render;
+		}
+		line->hl_open_comment = EditorHighlight(E.syntax, text, rsize, hl, entry);
+		line->hl_entry = entry;
+	}
+}
+
+// Makes sure a line has render and hl ready for drawing.
+linedisp_t *EditorLineDisplay(int at)
+{
+	EditorSyntaxCatchUp(at + 1);
+	line_t *line = EditorLine(at);
+	linedisp_t *d = EditorLineRender(line);
+	if (d->entry < 0 || d->entry != line->hl_entry)
+		EditorUpdateSyntax(at);
+	return d;
+}
+
+/*** Background Highlighter ***/
+
+// Walks the lines below the highlight frontier while the main thread waits
+// for input. Each batch is rendered into private memory under the lock,
+// highlighted without it, and published only if no edit bumped hl_gen in
+// the meantime. Only comment states are published; hl arrays are still
+// built by the main thread for the lines it draws.
+void EditorHighlightWorker(void *arg)
+{
+	char *render = NULL;
+	unsigned char *hl = NULL;
+	size_t rcap = 0, hlcap = 0;
+	size_t roff[KILO_HL_BATCH + 1];
+	int state[KILO_HL_BATCH];
+
+	MutexLock(&E.lock);
+	while (!E.hl_quit)
+	{
+		if (E.syntax == NULL || E.hl_valid >= E.linesnum)
+		{
+			CondWait(&E.hl_wake, &E.lock);
+			continue;
+		}
+
+		unsigned int gen = E.hl_gen;
+		struct EditorSyntax *syntax = E.syntax;
+		size_t start = E.hl_valid;
+		size_t n = E.linesnum - start;
+		size_t used = 0, i;
+		int entry = EditorSyntaxEntry(start);
+
+		if (n > KILO_HL_BATCH) n = KILO_HL_BATCH;
+		for (i = 0; i < n; i++)
+		{
+			line_t *line = EditorLine(start + i);
+			size_t need = EditorRenderSize(line);
+			if (used + need > rcap)
+			{
+				rcap = (used + need) * 2;
+				render = realloc(render, rcap);
+			}
+			roff[i] = used;
+			used += EditorRenderBytes(line, render + used) + 1;
+			if (used > KILO_HL_BATCH_BYTES)
+			{
+				n = i + 1;
+				break;
+			}
+		}
+		roff[n] = used;
+		MutexUnlock(&E.lock);
+
+		for (i = 0; i < n; i++)
+		{
+			size_t rsize = roff[i + 1] - roff[i] - 1;
+			if (rsize >= hlcap)
+			{
+				hlcap = rsize * 2 + 1;
+				hl = realloc(hl, hlcap);
+			}
+			entry = state[i] = EditorHighlight(syntax, render + roff[i], rsize, hl, entry);
+		}
+
+		MutexLock(&E.lock);
+		if (gen != E.hl_gen || start != E.hl_valid) continue;
+
+		entry = EditorSyntaxEntry(start);
+		for (i = 0; i < n; i++)
+		{
+			line_t *line = EditorLine(start + i);
+			line->hl_entry = entry;
+			line->hl_open_comment = entry = state[i];
+		}
+		E.hl_valid = start + n;
+	}
+	MutexUnlock(&E.lock);
+
+	free(render);
+	free(hl);
+}
+
+void EditorStartHighlighter(void)
+{
+	if (!KILO_HL_WORKER) return;
+
+	E.hl_quit = false;
+	E.hl_worker = ThreadStart(&E.hl_thread, EditorHighlightWorker, NULL);
+}
+
+void EditorStopHighlighter(void)
+{
+	if (!E.hl_worker) return;
+
+	E.hl_quit = true;
+	CondSignal(&E.hl_wake);
+	MutexUnlock(&E.lock);
+	ThreadJoin(&E.hl_thread);
+	MutexLock(&E.lock);
+	E.hl_worker = false;
+}
+
+// The main thread holds E.lock while it works on the lines and releases it
+// only around blocking input reads, which is when the worker gets to run.
+void EditorUnlock(void)
+{
+	if (E.hl_worker && E.hl_valid < E.linesnum)
+		CondSignal(&E.hl_wake);
+	MutexUnlock(&E.lock);
+}
+
+void EditorLock(void)
+{
+	MutexLock(&E.lock);
+}
+
+int EditorSyntaxToColor(int hl)
+{
+	switch(hl)
+	{
+		case HL_COMMENT:
+		case HL_MLCOMMENT: return 36;
+		case HL_KEYWORD1: return 33;
+		case HL_KEYWORD2: return 32;
+		case HL_STRING: return 35;
+		case HL_NUMBER: return 31;
+		case HL_MATCH: return 34;
+		default: return 37;
+	}
+}
+
+// Colours the len cells of attr with the highlight runs of d from render
+// column from on.
+void EditorHlDraw(linedisp_t *d, size_t from, unsigned char *attr, int len)
+{
+	size_t col = 0, r;
+	int j = 0;
+
+	for (r = 0; r < d->hlruns && j < len; r++)
+	{
+		size_t end = col + d->hl[2 * r];
+		unsigned char hl = d->hl[2 * r + 1];
+		unsigned char color = (hl == HL_NORMAL) ? 0 : EditorSyntaxToColor(hl);
+		for (col = col > from ? col : from; col < end && j < len; col++)
+			attr[j++] = color;
+		col = end;
+	}
+}
+
+/*** Syntax Definitions ***/
+
+// Adds ext to the extension map, replacing an earlier syntax using it.
+void SyntaxMapExtension(char *ext, struct EditorSyntax *syntax)
+{
+	if ((SDB.extlen + 1) * 2 > SDB.extmask + 1 || SDB.exts == NULL)
+	{
+		struct SyntaxExt *old = SDB.exts;
+		unsigned int oldsize = old ? SDB.extmask + 1 : 0;
+		unsigned int size = oldsize ? oldsize * 2 : 64;
+
+		SDB.exts = calloc(size, sizeof(struct SyntaxExt));
+		SDB.extmask = size - 1;
+		SDB.extlen = 0;
+		for (unsigned int j = 0; j < oldsize; j++)
+			if (old[j].ext)
+				SyntaxMapExtension(old[j].ext, old[j].syntax);
+		free(old);
+	}
+
+	unsigned int slot = KeywordHash(0, ext, strlen(ext)) & SDB.extmask;
+	while (SDB.exts[slot].ext && strcmp(SDB.exts[slot].ext, ext))
+		slot = (slot + 1) & SDB.extmask;
+	if (SDB.exts[slot].ext == NULL)
+		SDB.extlen++;
+	SDB.exts[slot].ext = ext;
+	SDB.exts[slot].syntax = syntax;
+}
+
+struct EditorSyntax *SyntaxByExtension(char *ext)
+{
+	if (SDB.exts == NULL) return NULL;
+
+	unsigned int slot = KeywordHash(0, ext, strlen(ext)) & SDB.extmask;
+	while (SDB.exts[slot].ext)
+	{
+		if (!strcmp(SDB.exts[slot].ext, ext))
+			return SDB.exts[slot].syntax;
+		slot = (slot + 1) & SDB.extmask;
+	}
+	return NULL;
+}
+
+void SyntaxRegister(struct EditorSyntax *syntax)
+{
+	SDB.entries = realloc(SDB.entries, sizeof(*SDB.entries) * (SDB.len + 1));
+	SDB.entries[SDB.len++] = syntax;
+
+	for (unsigned int i = 0; syntax->filematch[i]; i++)
+		if (syntax->filematch[i][0] == '.')
+			SyntaxMapExtension(syntax->filematch[i], syntax);
+}
+
+// Appends the blank separated words of value to a NULL terminated list,
+// adding suffix to each of them.
+char **SyntaxAppendWords(char **list, char *value, char *suffix)
+{
+	size_t n = 0;
+	while (list && list[n]) n++;
+
+	for (char *w = strtok(value, " \t"); w; w = strtok(NULL, " \t"))
+	{
+		list = realloc(list, sizeof(char *) * (n + 2));
+		list[n] = malloc(strlen(w) + strlen(suffix) + 1);
+		strcpy(list[n], w);
+		strcat(list[n], suffix);
+		list[++n] = NULL;
+	}
+	if (list == NULL)
+		list = calloc(1, sizeof(char *));
+	return list;
+}
+
+char *SyntaxTrim(char *s)
+{
+	while (isspace((unsigned char)*s)) s++;
+	char *end = s + strlen(s);
+	while (end > s && isspace((unsigned char)end[-1])) *--end = '\0';
+	return s;
+}
+
+// Loads one definition file. Each line is "key = value", '#' starts a
+// comment line. Keys:
+//	filetype	name shown in the status bar
+//	extensions	".ext" suffixes or file name substrings
+//	keywords	KEYWORD1 words (may repeat)
+//	types		KEYWORD2 words (may repeat)
+//	comment		single line comment start
+//	multiline	multiline comment start and end, blank separated
+//	strings		string delimiter characters, empty to disable strings
+//	numbers		"yes" or "no"
+//	number_chars	characters continuing a number after a digit
+//	separators	token separators besides blanks
+struct EditorSyntax *SyntaxLoadFile(char *path)
+{
+	FILE *fp = fopen(path, "r");
+	if (!fp) return NULL;
+
+	struct EditorSyntax *s = calloc(1, sizeof(*s));
+	char buf[BUFF_MAX];
+
+	s->flags = HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS;
+	while (fgets(buf, sizeof(buf), fp))
+	{
+		char *line = SyntaxTrim(buf);
+		char *eq = strchr(line, '=');
+		if (line[0] == '#' || eq == NULL) continue;
+
+		*eq = '\0';
+		char *key = SyntaxTrim(line);
+		char *value = SyntaxTrim(eq + 1);
+
+		if (!strcmp(key, "filetype"))
+			s->filetype = strdup(value);
+		else if (!strcmp(key, "extensions"))
+			s->filematch = SyntaxAppendWords(s->filematch, value, "");
+		else if (!strcmp(key, "keywords"))
+			s->keywords = SyntaxAppendWords(s->keywords, value, "");
+		else if (!strcmp(key, "types"))
+			s->keywords = SyntaxAppendWords(s->keywords, value, "|");
+		else if (!strcmp(key, "comment"))
+			s->singleline_comment_start = strdup(value);
+		else if (!strcmp(key, "multiline"))
+		{
+			char *mcs = strtok(value, " \t");
+			char *mce = strtok(NULL, " \t");
+			if (mcs && mce)
+			{
+				s->multiline_comment_start = strdup(mcs);
+				s->multiline_comment_end = strdup(mce);
+			}
+		}
+		else if (!strcmp(key, "strings"))
+		{
+			s->quotes = strdup(value);
+			if (value[0] == '\0')
+				s->flags &= ~HL_HIGHLIGHT_STRINGS;
+		}
+		else if (!strcmp(key, "numbers"))
+		{
+			if (strcmp(value, "yes"))
+				s->flags &= ~HL_HIGHLIGHT_NUMBERS;
+		}
+		else if (!strcmp(key, "number_chars"))
+			s->number_chars = strdup(value);
+		else if (!strcmp(key, "separators"))
+			s->separators = strdup(value);
+	}
+	fclose(fp);
+
+	if (s->filetype == NULL || s->filematch == NULL)
+	{
+		fprintf(stderr, "Syntax: %s needs a filetype and extensions.\n", path);
+		free(s);
+		return NULL;
+	}
+	if (s->keywords == NULL)
+		s->keywords = calloc(1, sizeof(char *));
+	return s;
+}
+
+// Registers every *.syn file in dir. Only the definitions are read here;
+// byte classes and keyword tables are compiled when a file first uses them.
+#ifdef _WIN32
+void SyntaxLoadDir(char *dir)
+{
+	char path[BUFF_MAX];
+	WIN32_FIND_DATAA fd;
+
+	snprintf(path, sizeof(path), "%s/*.syn", dir);
+	HANDLE hFind = FindFirstFileA(path, &fd);
+	if (hFind == INVALID_HANDLE_VALUE) return;
+
+	do
+	{
+		if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, fd.cFileName);
+		struct EditorSyntax *s = SyntaxLoadFile(path);
+		if (s)
+			SyntaxRegister(s);
+	} while (FindNextFileA(hFind, &fd));
+	FindClose(hFind);
+}
+#else
+void SyntaxLoadDir(char *dir)
+{
+	char path[BUFF_MAX];
+	struct dirent *de;
+	DIR *d = opendir(dir);
+	if (d == NULL) return;
+
+	while ((de = readdir(d)) != NULL)
+	{
+		size_t len = strlen(de->d_name);
+		if (len < 5 || strcmp(&de->d_name[len - 4], ".syn")) continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		struct EditorSyntax *s = SyntaxLoadFile(path);
+		if (s)
+			SyntaxRegister(s);
+	}
+	closedir(d);
+}
+#endif
+
+// Registers the built-in syntaxes, then the definitions found in
+// $WINKILO_SYNTAX or else the "syntax" directory next to the executable.
+void EditorLoadSyntaxes(char *argv0)
+{
+	char dir[BUFF_MAX];
+	char *env = getenv("WINKILO_SYNTAX");
+
+	for (unsigned int j = 0; j < HLDB_ENTRIES; j++)
+		SyntaxRegister(&HLDB[j]);
+
+	if (env)
+	{
+		snprintf(dir, sizeof(dir), "%s", env);
+	}
 	else
 	{
-		E.cursor = saved_cursor;
-		E.offset = saved_offset;
+		char *slash = strrchr(argv0, '/');
+		char *bslash = strrchr(argv0, '\\');
+		if (bslash > slash) slash = bslash;
+		if (slash)
+			snprintf(dir, sizeof(dir), "%.*s/syntax", (int)(slash - argv0), argv0);
+		else
+			snprintf(dir, sizeof(dir), "syntax");
+	}
+	SyntaxLoadDir(dir);
+}
+
+void EditorSelectSyntaxHighlight()
+{
+	E.syntax = NULL;
+	if (E.filename == NULL) return;
+
+	char *ext = strrchr(E.filename, '.');
+	struct EditorSyntax *s = ext ? SyntaxByExtension(ext) : NULL;
+
+	// File name patterns are rare enough to be matched one by one.
+	for (size_t j = SDB.len; s == NULL && j > 0; j--)
+	{
+		struct EditorSyntax *t = SDB.entries[j - 1];
+		for (unsigned int i = 0; t->filematch[i]; i++)
+		{
+			if (t->filematch[i][0] != '.' && strstr(E.filename, t->filematch[i]))
+			{
+				s = t;
+				break;
+			}
+		}
+	}
+	if (s == NULL) return;
+
+	EditorSyntaxCompile(s);
+	E.syntax = s;
+
+	for (size_t filerow = 0; filerow < E.linesnum; filerow++)
+		EditorLine(filerow)->hl_entry = -1;
+	EditorInvalidateSyntax(0);
+}
+
+/*** Undo ***/
+
+// Operations come in pairs, each undone by its partner: op ^ 1.
+enum UndoOp {
+	UNDO_INSERT_TEXT = 0,	// The bytes went in at y, x.
+	UNDO_DELETE_TEXT,	// The bytes came out at y, x.
+	UNDO_INSERT_LINES,	// x lines went in at y, the bytes hold them separated by \n.
+	UNDO_DELETE_LINES,	// x lines came out at y.
+	UNDO_SPLIT,		// Line y was split at x.
+	UNDO_JOIN		// Line y + 1 was appended to line y, x bytes long.
+};
+
+#define UNDO_STEP 1	// First record of a step: steps are undone as a whole.
+#define UNDO_TYPED 2	// One typed character, which the next ones in a row join.
+
+// A record of the undo log, followed by its bytes padded to 4.
+typedef struct undo {
+	uint32_t prev;	// Size of the record before, 0 for the first one.
+	uint32_t len;
+	int32_t y;
+	int32_t x;
+	uint8_t op;
+	uint8_t flags;
+} undo_t;
+
+// Edits as a log of records in one buffer, oldest first. The records up to
+// at are applied, the ones after it were undone and can be redone until
+// the next edit. Every key handled is a step. Once the log outgrows
+// KILO_UNDO_MAX the oldest steps are dropped.
+struct Undo {
+	char *log;
+	size_t len;
+	size_t cap;
+	size_t at;
+	size_t top;		// Record ending at at.
+	size_t clean;		// at when the file was opened or saved, SIZE_MAX once dropped.
+	unsigned int step;	// Bumped for every key.
+	unsigned int recstep;	// Step of the newest record.
+	unsigned int typestep;	// Step typing or deleting a single character.
+	unsigned int edits;	// Bumped for every edit, undone or redone ones too.
+	bool overflow;		// recstep didn't fit in the log and isn't recorded.
+	bool replaying;		// Undoing or redoing: edits aren't logged again.
+	int nested;		// Inside a compound edit, which is logged as a whole.
+} Undo;
+
+size_t UndoSize(size_t len)
+{
+	return sizeof(undo_t) + ((len + 3) & ~(size_t)3);
+}
+
+bool UndoReserve(size_t len)
+{
+	if (len <= Undo.cap) return true;
+
+	size_t cap = Undo.cap ? Undo.cap : 4096;
+	while (cap < len)
+		cap *= 2;
+	char *log = PerfRealloc(Undo.log, cap);
+	if (log == NULL) return false;
+	Undo.log = log;
+	Undo.cap = cap;
+	return true;
+}
+
+void UndoReset(void)
+{
+	free(Undo.log);
+	memset(&Undo, 0, sizeof(Undo));
+}
+
+// Drops the oldest steps until the log is back to 3/4 of KILO_UNDO_MAX. A
+// step that can't fit on its own clears the log.
+void UndoTrim(void)
+{
+	size_t off = 0;
+
+	while (off < Undo.len)
+	{
+		undo_t *u = (undo_t *)&Undo.log[off];
+		if ((u->flags & UNDO_STEP) && Undo.len - off <= KILO_UNDO_MAX / 4 * 3)
+			break;
+		off += UndoSize(u->len);
+	}
+	if (off >= Undo.len)
+	{
+		Undo.len = Undo.at = Undo.top = 0;
+		Undo.clean = SIZE_MAX;
+		Undo.overflow = true;
+		return;
+	}
+	memmove(Undo.log, &Undo.log[off], Undo.len - off);
+	Undo.len -= off;
+	Undo.at -= off;
+	Undo.top -= off;
+	Undo.clean = (Undo.clean != SIZE_MAX && Undo.clean >= off) ? Undo.clean - off : SIZE_MAX;
+	((undo_t *)Undo.log)->prev = 0;
+}
+
+// Adds an edit to the newest record when it carries on from it: typed
+// characters in a row, or lines inserted or deleted one after the other
+// by the same step.
+bool UndoJoin(int op, int y, int x, const char *s, size_t len, bool newstep)
+{
+	undo_t *u = (undo_t *)&Undo.log[Undo.top];
+	bool typed = len == 1 && Undo.typestep == Undo.step && (u->flags & UNDO_TYPED) && u->len < KILO_UNDO_RUN;
+	bool prepend = false;
+
+	if (u->op != op || u->len + len + 1 >= UINT32_MAX)
+		return false;
+	if (op != UNDO_INSERT_LINES && u->y != y)
+		return false;
+	switch (op)
+	{
+		case UNDO_INSERT_TEXT:
+			if (!typed || x != u->x + (int)u->len) return false;
+			break;
+		case UNDO_DELETE_TEXT:
+			if (!typed || (x != u->x && x + 1 != u->x)) return false;
+			prepend = x + 1 == u->x;
+			break;
+		case UNDO_INSERT_LINES:
+		case UNDO_DELETE_LINES:
+			if (newstep || (op == UNDO_INSERT_LINES && y != u->y + u->x)) return false;
+			break;
+		default:
+			return false;
+	}
+
+	size_t extra = (op == UNDO_INSERT_LINES || op == UNDO_DELETE_LINES) ? len + 1 : len;
+	if (!UndoReserve(Undo.top + UndoSize(u->len + extra)))
+		return false;
+	u = (undo_t *)&Undo.log[Undo.top];
+	char *bytes = (char *)(u + 1);
+	if (prepend)
+	{
+		memmove(bytes + 1, bytes, u->len);
+		bytes[0] = s[0];
+		u->x = x;
+	}
+	else if (extra > len)
+	{
+		bytes[u->len] = '\n';
+		memcpy(&bytes[u->len + 1], s, len);
+		u->x++;
+	}
+	else
+	{
+		memcpy(&bytes[u->len], s, len);
+	}
+	u->len += extra;
+	Undo.at = Undo.len = Undo.top + UndoSize(u->len);
+	return true;
+}
+
+// Logs an edit about to be made, or just made for insertions, and passes
+// it on to the journal. Any undone records are dropped.
+void UndoRecord(int op, int y, int x, const char *s, size_t len)
+{
+	Undo.edits++;
+	if (Undo.nested)
+		return;
+	JournalRecord(op, y, x, s, len);
+	if (Undo.replaying || (Undo.overflow && Undo.recstep == Undo.step))
+		return;
+
+	bool newstep = Undo.at == 0 || Undo.recstep != Undo.step;
+	Undo.len = Undo.at;
+	if (Undo.clean != SIZE_MAX && Undo.clean > Undo.at)
+		Undo.clean = SIZE_MAX;
+	Undo.recstep = Undo.step;
+	Undo.overflow = false;
+	if (Undo.at > 0 && UndoJoin(op, y, x, s, len, newstep))
+	{
+		if (Undo.len > KILO_UNDO_MAX)
+			UndoTrim();
+		return;
+	}
+
+	if (len >= UINT32_MAX || !UndoReserve(Undo.at + UndoSize(len)))
+	{
+		Undo.len = Undo.at = Undo.top = 0;
+		Undo.clean = SIZE_MAX;
+		Undo.overflow = true;
+		return;
+	}
+	undo_t *u = (undo_t *)&Undo.log[Undo.at];
+	u->prev = Undo.at - Undo.top;
+	u->len = len;
+	u->y = y;
+	u->x = x;
+	u->op = op;
+	u->flags = newstep ? UNDO_STEP : 0;
+	if (len == 1 && Undo.typestep == Undo.step && (op == UNDO_INSERT_TEXT || op == UNDO_DELETE_TEXT))
+		u->flags |= UNDO_TYPED;
+	if (len)
+		memcpy(u + 1, s, len);
+	Undo.top = Undo.at;
+	Undo.at = Undo.len = Undo.at + UndoSize(len);
+	if (Undo.len > KILO_UNDO_MAX)
+		UndoTrim();
+}
+
+/*** Journal ***/
+
+// The file contents a journal applies to, as opened or last saved.
+typedef struct journalhead {
+	char magic[4];
+	uint32_t sample;	// Hash of the first and last KILO_JOURNAL_SAMPLE bytes.
+	uint64_t size;
+	int64_t mtime;
+} journalhead_t;
+
+// Edits not saved yet are appended to the file name plus
+// KILO_JOURNAL_SUFFIX, so that they can be replayed if the editor dies.
+// Records are laid out as in the undo log, but never joined, and prev
+// holds a checksum that stops replay at a torn write. The main thread only
+// copies them to buf. A writer thread writes them out every
+// KILO_JOURNAL_BATCH_MS while edits come in, and only needs waking once it
+// has gone idle. The file is synced every KILO_JOURNAL_SYNC_MS.
+struct Journal {
+	char *path;
+	FILE *fp;		// Used by the writer only.
+	char *buf;		// Records waiting for the writer.
+	size_t len;
+	size_t cap;
+	journalhead_t head;	// Header the file starts over with.
+	bool reset;		// Start the file over: the text was opened or saved.
+	bool quit;
+	bool idle;		// The writer waits to be woken up.
+	mutex_t lock;		// Guards the fields above.
+	cond_t wake;
+	thread_t thread;
+	bool running;
+	char *kept;		// Records since a save began, queued again once it is done.
+	size_t keptlen;
+	size_t keptcap;
+	bool keeping;
+} Journal;
+
+void JournalHead(journalhead_t *head)
+{
+	size_t n = (E.basesize < KILO_JOURNAL_SAMPLE) ? E.basesize : KILO_JOURNAL_SAMPLE;
+
+	memset(head, 0, sizeof(*head));
+	memcpy(head->magic, "WKJ1", 4);
+	if (n)
+		head->sample = KeywordHash(KeywordHash(0, E.base, n), E.base + E.basesize - n, n);
+	head->size = E.basesize;
+	head->mtime = FileTime(E.filename);
+}
+
+uint32_t JournalChecksum(undo_t *u, const char *s)
+{
+	return KeywordHash(KeywordHash(0, (char *)u + 4, sizeof(*u) - 4), s, u->len);
+}
+
+void JournalWrite(void *arg)
+{
+	char *batch = NULL;
+	size_t batchcap = 0;
+	bool unsynced = false;
+	double synced = ClockNow(), active = 0;
+
+	MutexLock(&Journal.lock);
+	while (1)
+	{
+		if (!Journal.reset && !Journal.quit)
+		{
+			if (unsynced || ClockNow() - active < KILO_JOURNAL_SYNC_MS / 1e3)
+			{
+				CondWaitFor(&Journal.wake, &Journal.lock, KILO_JOURNAL_BATCH_MS);
+			}
+			else
+			{
+				Journal.idle = true;
+				CondWait(&Journal.wake, &Journal.lock);
+				Journal.idle = false;
+			}
+		}
+
+		// Swap buffers, so that the main thread goes on filling the other.
+		char *full = Journal.buf;
+		size_t fullcap = Journal.cap, n = Journal.len;
+		bool reset = Journal.reset, quit = Journal.quit;
+		journalhead_t head = Journal.head;
+		Journal.buf = batch;
+		Journal.cap = batchcap;
+		Journal.len = 0;
+		Journal.reset = false;
+		batch = full;
+		batchcap = fullcap;
+		MutexUnlock(&Journal.lock);
+
+		if (reset)
+		{
+			if (Journal.fp)
+				fclose(Journal.fp);
+			Journal.fp = fopen(Journal.path, "wb");
+			if (Journal.fp)
+				fwrite(&head, sizeof(head), 1, Journal.fp);
+		}
+		if (Journal.fp && (reset || n))
+		{
+			if (n)
+				fwrite(batch, 1, n, Journal.fp);
+			fflush(Journal.fp);
+			active = ClockNow();
+			unsynced = true;
+		}
+		if (unsynced && (quit || ClockNow() - synced >= KILO_JOURNAL_SYNC_MS / 1e3))
+		{
+			// A journal that couldn't be opened again has nothing to sync.
+			if (Journal.fp)
+				FileSync(Journal.fp);
+			synced = ClockNow();
+			unsynced = false;
+		}
+
+		MutexLock(&Journal.lock);
+		if (Journal.quit && Journal.len == 0 && !Journal.reset && !unsynced)
+			break;
+	}
+	MutexUnlock(&Journal.lock);
+	free(batch);
+}
+
+// Writes out the records still waiting and stops the writer. The journal
+// is removed when its edits are no longer wanted.
+void JournalClose(bool discard)
+{
+	if (!Journal.running) return;
+
+	MutexLock(&Journal.lock);
+	Journal.quit = true;
+	CondSignal(&Journal.wake);
+	MutexUnlock(&Journal.lock);
+	ThreadJoin(&Journal.thread);
+
+	if (Journal.fp)
+		fclose(Journal.fp);
+	if (discard)
+		remove(Journal.path);
+	free(Journal.path);
+	free(Journal.buf);
+	free(Journal.kept);
+	Journal.path = NULL;
+	Journal.fp = NULL;
+	Journal.buf = NULL;
+	Journal.len = Journal.cap = 0;
+	Journal.kept = NULL;
+	Journal.keptlen = Journal.keptcap = 0;
+	Journal.keeping = false;
+	Journal.quit = false;
+	Journal.idle = false;
+	Journal.running = false;
+}
+
+// Grows *buf to hold need bytes.
+bool JournalGrow(char **buf, size_t *cap, size_t need)
+{
+	if (need <= *cap) return true;
+
+	size_t newcap = *cap ? *cap : 4096;
+	while (newcap < need)
+		newcap *= 2;
+	char *p = PerfRealloc(*buf, newcap);
+	if (p == NULL) return false;
+	*buf = p;
+	*cap = newcap;
+	return true;
+}
+
+// Starts the journal of E.filename over, for the text just opened or saved.
+// Records kept since the save began carry over, as the file lacks them.
+void JournalReset(void)
+{
+	if (E.filename == NULL) return;
+
+	size_t len = strlen(E.filename);
+	if (Journal.running && (strncmp(Journal.path, E.filename, len) || strcmp(&Journal.path[len], KILO_JOURNAL_SUFFIX)))
+		JournalClose(false);
+	if (!Journal.running)
+	{
+		Journal.path = malloc(len + sizeof(KILO_JOURNAL_SUFFIX));
+		memcpy(Journal.path, E.filename, len);
+		memcpy(&Journal.path[len], KILO_JOURNAL_SUFFIX, sizeof(KILO_JOURNAL_SUFFIX));
+		Journal.running = ThreadStart(&Journal.thread, JournalWrite, NULL);
+		if (!Journal.running)
+		{
+			free(Journal.path);
+			Journal.path = NULL;
+			return;
+		}
+	}
+
+	MutexLock(&Journal.lock);
+	JournalHead(&Journal.head);
+	Journal.len = 0;
+	if (Journal.keeping && JournalGrow(&Journal.buf, &Journal.cap, Journal.keptlen))
+	{
+		if (Journal.keptlen)
+			memcpy(Journal.buf, Journal.kept, Journal.keptlen);
+		Journal.len = Journal.keptlen;
+	}
+	Journal.reset = true;
+	CondSignal(&Journal.wake);
+	MutexUnlock(&Journal.lock);
+}
+
+// Lays out record u with its bytes s at p.
+void JournalPut(char *p, undo_t *u, const char *s)
+{
+	memcpy(p, u, sizeof(*u));
+	if (u->len)
+		memcpy(p + sizeof(*u), s, u->len);
+	memset(p + sizeof(*u) + u->len, 0, UndoSize(u->len) - sizeof(*u) - u->len);
+}
+
+// Queues an edit for the writer, and keeps it while a save is in progress.
+void JournalRecord(int op, int y, int x, const char *s, size_t len)
+{
+	undo_t u;
+
+	if (!Journal.running || len >= UINT32_MAX) return;
+
+	memset(&u, 0, sizeof(u));
+	u.len = len;
+	u.y = y;
+	u.x = x;
+	u.op = op;
+	u.prev = JournalChecksum(&u, s);
+
+	size_t size = UndoSize(len);
+	MutexLock(&Journal.lock);
+	if (!JournalGrow(&Journal.buf, &Journal.cap, Journal.len + size))
+	{
+		MutexUnlock(&Journal.lock);
+		return;
+	}
+	JournalPut(&Journal.buf[Journal.len], &u, s);
+	if (Journal.idle)
+		CondSignal(&Journal.wake);
+	Journal.idle = false;
+	Journal.len += size;
+	MutexUnlock(&Journal.lock);
+
+	if (Journal.keeping && JournalGrow(&Journal.kept, &Journal.keptcap, Journal.keptlen + size))
+	{
+		JournalPut(&Journal.kept[Journal.keptlen], &u, s);
+		Journal.keptlen += size;
+	}
+}
+
+// Starts or stops keeping the records made while a save is in progress.
+void JournalKeep(bool keep)
+{
+	Journal.keeping = keep;
+	Journal.keptlen = 0;
+	if (!keep)
+	{
+		free(Journal.kept);
+		Journal.kept = NULL;
+		Journal.keptcap = 0;
+	}
+}
+
+/*** Line Operations ***/
+int EditorLineCxToRx(line_t *line, int cx)
+{
+	int j, rx = 0;
+	for (j = 0; j < cx; j++)
+	{
+		if (line->bytes[j] == '\t')
+			rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+		rx++;
+	}
+
+	return rx;
+}
+
+int EditorLineRxToCx(line_t *line, int rx)
+{
+	int cx, cur_rx = 0;
+	for (cx = 0; cx < line->size; cx++)
+	{
+		if (line->bytes[cx] == '\t')
+			cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
+		cur_rx++;
+
+		if (cur_rx > rx) return cx;
+	}
+
+	return cx;
+}
+
+// Bytes needed to render line, including the terminating NUL.
+size_t EditorRenderSize(line_t *line)
+{
+	size_t j, tabs = 0;
+
+	for (j = 0; j < line->size; j++)
+		if (line->bytes[j] == '\t')
+			tabs++;
+
+	return line->size + tabs * (KILO_TAB_STOP - 1) + 1;
+}
+
+// Expands the tabs of line into render. Returns the rendered length.
+size_t EditorRenderBytes(line_t *line, char *render)
+{
+	size_t j, idx = 0;
+
+	for (j = 0; j < line->size; j++)
+	{
+		if (line->bytes[j] == '\t')
+		{
+			render[idx++] = ' ';
+			while (idx % KILO_TAB_STOP != 0)
+				render[idx++] = ' ';
+		}
+		else
+		{
+			render[idx++] = line->bytes[j];
+		}
+	}
+	render[idx] = '\0';
+	return idx;
+}
+
+// The display of a line, with its tabs expanded if it has any.
+linedisp_t *EditorLineRender(line_t *line)
+{
+	linedisp_t *d = EditorLineDisp(line);
+	if (d) return d;
+
+	d = EditorLineDispNew(line);
+	d->rsize = line->size;
+	if (memchr(line->bytes, '\t', line->size))
+	{
+		size_t need = EditorRenderSize(line);
+		if (need > d->rcap)
+		{
+			char *render = PerfRealloc(d->render, need);
+			if (render == NULL)
+			{
+				perror("Line Storage: ");
+				exit(1);
+			}
+			d->render = render;
+			d->rcap = need;
+		}
+		d->rsize = EditorRenderBytes(line, d->render);
+		d->tabs = true;
+	}
+	return d;
+}
+
+// Called after the bytes of line at changed. Render and hl are dropped to
+// be rebuilt when the line is drawn.
+void EditorUpdateLine(int at)
+{
+	line_t *line = EditorLine(at);
+
+	EditorLineDispFree(line);
+	line->hl_entry = -1;
+	EditorInvalidateSyntax(at);
+}
+
+// Gives a line a copy of len bytes at s. Render and hl are dropped to be
+// rebuilt when the line is drawn; the caller invalidates the highlighting.
+void EditorLineSetBytes(line_t *line, const char *s, size_t len)
+{
+	char *bytes = LineAlloc(len + 1);
+	memcpy(bytes, s, len);
+	bytes[len] = '\0';
+	if (!line->mapped)
+		LineFree(line->bytes, line->size + 1);
+	line->bytes = bytes;
+	line->size = len;
+	line->mapped = false;
+	EditorLineDispFree(line);
+	line->hl_entry = -1;
+}
+
+// Gives a mapped line its own heap copy so it can be modified.
+void EditorLineOwn(line_t *line)
+{
+	if (!line->mapped) return;
+
+	char *bytes = LineAlloc(line->size + 1);
+	memcpy(bytes, line->bytes, line->size);
+	bytes[line->size] = '\0';
+	line->bytes = bytes;
+	line->mapped = false;
+}
+
+void EditorInsertLine(int at, char *s, size_t len)
+{
+	if (at < 0 || at > E.linesnum) return;
+
+	EditorGrowLines(1);
+	EditorMoveGap(at);
+
+	line_t *line = &E.line[E.gap++];
+	E.linesnum++;
+
+	line->size = len;
+	line->bytes = LineAlloc(len + 1);
+	memcpy(line->bytes, s, len);
+	line->bytes[len] = '\0';
+	line->disp = 0;
+	line->hl_open_comment = 0;
+	line->hl_entry = -1;
+	line->mapped = false;
+	EditorInvalidateSyntax(at);
+	UndoRecord(UNDO_INSERT_LINES, at, 1, s, len);
+
+	E.dirty++;
+}
+
+void EditorFreeLine(line_t *line)
+{
+	EditorLineDispFree(line);
+	if (!line->mapped)
+		LineFree(line->bytes, line->size + 1);
+}
+
+// Inserts the lines of s, separated by \n, at line at.
+void EditorInsertLines(int at, const char *s, size_t len)
+{
+	const char *end = s + len;
+
+	while (1)
+	{
+		const char *nl = memchr(s, '\n', end - s);
+		EditorInsertLine(at++, (char *)s, (nl ? nl : end) - s);
+		if (nl == NULL)
+			break;
+		s = nl + 1;
+	}
+}
+
+void EditorDelLine(int at)
+{
+	if (at < 0 || at >= E.linesnum) return;
+	line_t *line = EditorLine(at);
+	UndoRecord(UNDO_DELETE_LINES, at, 1, line->bytes, line->size);
+	EditorMoveGap(at);
+	EditorFreeLine(EditorLine(at));
+	EditorInvalidateSyntax(at);
+	E.linesnum--;
+	E.dirty++;
+}
+
+void EditorLineInsertText(int row, int at, const char *s, size_t len)
+{
+	line_t *line = EditorLine(row);
+	if (at < 0 || at > line->size)
+		at = line->size;
+	UndoRecord(UNDO_INSERT_TEXT, row, at, s, len);
+	EditorLineOwn(line);
+	line->bytes = LineResize(line->bytes, line->size + 1, line->size + len + 1);
+	memmove(&line->bytes[at + len], &line->bytes[at], line->size - at + 1);
+	memcpy(&line->bytes[at], s, len);
+	line->size += len;
+	EditorUpdateLine(row);
+	E.dirty++;
+}
+
+void EditorLineInsertChar(int row, int at, int c)
+{
+	char ch = c;
+	EditorLineInsertText(row, at, &ch, 1);
+}
+
+void EditorLineDelText(int row, int at, size_t len)
+{
+	line_t *line = EditorLine(row);
+	if (at < 0 || at + len > line->size) return;
+	UndoRecord(UNDO_DELETE_TEXT, row, at, &line->bytes[at], len);
+	EditorLineOwn(line);
+	memmove(&line->bytes[at], &line->bytes[at + len], line->size - at - len + 1);
+	line->bytes = LineResize(line->bytes, line->size + 1, line->size - len + 1);
+	line->size -= len;
+	EditorUpdateLine(row);
+	E.dirty++;
+}
+
+// Moves the bytes of line row from at on to a new line below it.
+void EditorLineSplit(int row, int at)
+{
+	line_t *line = EditorLine(row);
+	if (at < 0 || at > line->size) return;
+	UndoRecord(UNDO_SPLIT, row, at, NULL, 0);
+	Undo.nested++;
+	EditorInsertLine(row + 1, &line->bytes[at], line->size - at);
+	Undo.nested--;
+	line = EditorLine(row);
+	EditorLineOwn(line);
+	line->bytes = LineResize(line->bytes, line->size + 1, at + 1);
+	line->size = at;
+	line->bytes[at] = '\0';
+	EditorUpdateLine(row);
+}
+
+// Appends line row + 1 to line row.
+void EditorLineJoin(int row)
+{
+	if (row < 0 || row + 1 >= E.linesnum) return;
+	line_t *next = EditorLine(row + 1);
+	UndoRecord(UNDO_JOIN, row, EditorLine(row)->size, NULL, 0);
+	Undo.nested++;
+	EditorLineInsertText(row, EditorLine(row)->size, next->bytes, next->size);
+	EditorDelLine(row + 1);
+	Undo.nested--;
+}
+
+/*** Editor Operations ***/
+void EditorInsertChar(int c)
+{
+	Undo.typestep = Undo.step;
+	if (E.cursor.Y == E.linesnum)
+	{
+		EditorInsertLine(E.linesnum, "", 0);
+	}
+	EditorLineInsertChar(E.cursor.Y, E.cursor.X, c);
+	E.cursor.X++;
+}
+
+// Inserts a block of text at the cursor as one edit. The lines it spans
+// are spliced in at once and only rendered when drawn. \r\n, \r and \n
+// all break lines.
+void EditorInsertText(const char *s, size_t len)
+{
+	if (len == 0) return;
+	if (E.cursor.Y == E.linesnum)
+		EditorInsertLine(E.linesnum, "", 0);
+
+	int row = E.cursor.Y;
+	line_t *line = EditorLine(row);
+	size_t at = (E.cursor.X < line->size) ? E.cursor.X : line->size;
+	size_t first = 0;
+	while (first < len && s[first] != '\r' && s[first] != '\n')
+		first++;
+
+	if (first == len)
+	{
+		EditorLineInsertText(row, at, s, len);
+		E.cursor.X = at + len;
+		return;
+	}
+
+	// The text after the cursor moves to a line of its own, which the last
+	// line of s is inserted at the start of.
+	EditorLineSplit(row, at);
+	EditorLineInsertText(row, at, s, first);
+
+	size_t p = first;
+	size_t q;
+	do
+	{
+		p += (s[p] == '\r' && p + 1 < len && s[p + 1] == '\n') ? 2 : 1;
+		q = p;
+		while (q < len && s[q] != '\r' && s[q] != '\n')
+			q++;
+		row++;
+		if (q < len)
+			EditorInsertLine(row, (char *)&s[p], q - p);
+		else
+			EditorLineInsertText(row, 0, &s[p], q - p);
+		E.cursor.X = q - p;
+		p = q;
+	} while (p < len);
+
+	E.cursor.Y = row;
+}
+
+void EditorInsertNewLine(void)
+{
+	if (E.cursor.X == 0)
+	{
+		EditorInsertLine(E.cursor.Y, "", 0);
+	}
+	else
+	{
+		EditorLineSplit(E.cursor.Y, E.cursor.X);
+	}
+	E.cursor.X = 0;
+	E.cursor.Y++;
+}
+
+void EditorDelChar(void)
+{
+	if (E.cursor.Y == E.linesnum) return;
+	if (E.cursor.X == 0 && E.cursor.Y == 0) return;
+
+	Undo.typestep = Undo.step;
+	if (E.cursor.X > 0)
+	{
+		EditorLineDelText(E.cursor.Y, E.cursor.X - 1, 1);
+		E.cursor.X--;
+	}
+	else
+	{
+		E.cursor.X = EditorLine(E.cursor.Y - 1)->size;
+		EditorLineJoin(E.cursor.Y - 1);
+		E.cursor.Y--;
+	}
+}
+
+// Applies record u, or reverts it when undo is set, and leaves the cursor
+// where the change was. When undoing nothing is added to the log meanwhile,
+// so u stays put.
+void EditorUndoApply(undo_t *u, bool undo)
+{
+	const char *s = (const char *)(u + 1);
+	int op = undo ? u->op ^ 1 : u->op;
+	int i;
+
+	E.cursor.Y = u->y;
+	E.cursor.X = u->x;
+	switch (op)
+	{
+		case UNDO_INSERT_TEXT:
+			EditorLineInsertText(u->y, u->x, s, u->len);
+			if (!undo)
+				E.cursor.X += u->len;
+			break;
+		case UNDO_DELETE_TEXT:
+			EditorLineDelText(u->y, u->x, u->len);
+			break;
+		case UNDO_INSERT_LINES:
+			EditorInsertLines(u->y, s, u->len);
+			E.cursor.X = 0;
+			break;
+		case UNDO_DELETE_LINES:
+			for (i = 0; i < u->x; i++)
+				EditorDelLine(u->y);
+			E.cursor.X = 0;
+			break;
+		case UNDO_SPLIT:
+			EditorLineSplit(u->y, u->x);
+			break;
+		case UNDO_JOIN:
+			EditorLineJoin(u->y);
+			break;
+	}
+}
+
+void EditorUndoDone(void)
+{
+	if (E.cursor.Y > E.linesnum)
+		E.cursor.Y = E.linesnum;
+	if (E.cursor.Y == E.linesnum)
+		E.cursor.X = 0;
+	else if (E.cursor.X > EditorLine(E.cursor.Y)->size)
+		E.cursor.X = EditorLine(E.cursor.Y)->size;
+	if (Undo.at == Undo.clean)
+		E.dirty = 0;
+}
+
+// Reverts the newest step still applied.
+void EditorUndo(void)
+{
+	undo_t *u;
+
+	if (Undo.at == 0)
+	{
+		EditorSetStatusMessage("Nothing to undo");
+		return;
+	}
+	Undo.replaying = true;
+	do
+	{
+		u = (undo_t *)&Undo.log[Undo.top];
+		EditorUndoApply(u, true);
+		Undo.at = Undo.top;
+		Undo.top -= u->prev;
+	} while (!(u->flags & UNDO_STEP) && Undo.at > 0);
+	Undo.replaying = false;
+	EditorUndoDone();
+}
+
+// Applies the oldest step undone again.
+void EditorRedo(void)
+{
+	undo_t *u;
+
+	if (Undo.at == Undo.len)
+	{
+		EditorSetStatusMessage("Nothing to redo");
+		return;
+	}
+	Undo.replaying = true;
+	do
+	{
+		u = (undo_t *)&Undo.log[Undo.at];
+		EditorUndoApply(u, false);
+		Undo.top = Undo.at;
+		Undo.at += UndoSize(u->len);
+		u = (undo_t *)&Undo.log[Undo.at];
+	} while (Undo.at < Undo.len && !(u->flags & UNDO_STEP));
+	Undo.replaying = false;
+	EditorUndoDone();
+}
+
+/*** File I/O ***/
+// A save in progress. It holds the lines as they stood when it began, and
+// they only borrow their bytes from it until it is done: an edit copies a
+// line before changing it, and a line deleted leaves its bytes behind. A
+// writer thread writes them out while editing goes on. Stretches of lines
+// still in the file are copied from it by the kernel, and when the lines
+// changed leave all others where they were, only they are written over
+// the file in place.
+struct Save {
+	struct savedline {
+		char *bytes;	// In E.base, else on the heap and owned by the save.
+		size_t size;
+	} *line;
+	size_t count;
+	size_t total;		// Bytes to write.
+	size_t written;		// Bytes written so far.
+	char *target;		// The file, with symbolic links resolved.
+	char *tmp;		// Copy being written next to target, renamed over it once done.
+	char *base;		// E.base when it maps the file, else NULL.
+	size_t basesize;
+	fileid_t baseid;	// E.baseid, and after a patch the file as patched.
+	bool patched;		// The file was patched in place, tmp held the patch.
+	size_t changed;		// Bytes written in place.
+	unsigned int edits;	// Undo.edits when the save began.
+	double start;
+	int error;		// errno of a failed write.
+	bool ok;
+	bool done;		// The writer has finished.
+	bool running;		// The writer was started and not joined yet.
+	mutex_t lock;		// Guards written, error, ok and done.
+	thread_t thread;
+} Save;
+
+// Whether p points into the file, or right past its end for an empty
+// last line.
+bool SaveInFile(const char *p)
+{
+	return Save.base && (uintptr_t)p - (uintptr_t)Save.base <= Save.basesize;
+}
+
+// Bytes of the lines from j on that lie back to back in the file, joined
+// by '\n' as they are saved. Sets next to the line after them.
+size_t SaveExtent(size_t j, size_t *next)
+{
+	struct savedline *line = &Save.line[j];
+	size_t k = j;
+
+	*next = j + 1;
+	if (!SaveInFile(line->bytes))
+		return 0;
+	while (k + 1 < Save.count && Save.line[k + 1].bytes == Save.line[k].bytes + Save.line[k].size + 1 &&
+		Save.line[k].bytes[Save.line[k].size] == '\n')
+		k++;
+	*next = k + 1;
+	return Save.line[k].bytes + Save.line[k].size - line->bytes;
+}
+
+// Writes the saved lines joined with '\n' to fp, gathered into writes of
+// KILO_SAVE_BUFFER bytes; longer lines are written directly. Stretches of
+// at least KILO_SAVE_COPY_MIN bytes still in the file are copied from in
+// when given.
+bool SaveWriteLines(FILE *fp, FILE *in)
+{
+	char *buf = malloc(KILO_SAVE_BUFFER);
+	size_t used = 0, done = 0, next = 0, j;
+	bool ok = buf != NULL;
+
+	for (j = 0; ok && j < Save.count; j++)
+	{
+		struct savedline *line = &Save.line[j];
+		size_t extent = (in && j >= next) ? SaveExtent(j, &next) : 0;
+		if (extent >= KILO_SAVE_COPY_MIN)
+		{
+			size_t off = line->bytes - Save.base;
+			ok = fwrite(buf, 1, used, fp) == used;
+			size_t copied = ok ? FileCopyRange(in, off, fp, extent) : 0;
+			ok = ok && fwrite(Save.base + off + copied, 1, extent - copied, fp) == extent - copied;
+			done += used + extent;
+			used = 0;
+			j = next - 1;
+		}
+		else
+		{
+			if (used + line->size + 1 > KILO_SAVE_BUFFER)
+			{
+				ok = fwrite(buf, 1, used, fp) == used;
+				done += used;
+				used = 0;
+			}
+			if (line->size + 1 > KILO_SAVE_BUFFER)
+			{
+				ok = ok && fwrite(line->bytes, 1, line->size, fp) == line->size;
+				done += line->size;
+			}
+			else
+			{
+				memcpy(&buf[used], line->bytes, line->size);
+				used += line->size;
+			}
+		}
+		if (j + 1 < Save.count)
+			buf[used++] = '\n';
+		if (done != Save.written)
+		{
+			MutexLock(&Save.lock);
+			Save.written = done;
+			MutexUnlock(&Save.lock);
+		}
+	}
+	if (ok && used)
+		ok = fwrite(buf, 1, used, fp) == used;
+	free(buf);
+	return ok;
+}
+
+// Whether the file can be patched in place: every line saved from the file
+// is still where it was, with a '\n' after it, and the size is the same.
+// Sets changed to the bytes of the other lines, which must come to at
+// most 1/KILO_SAVE_PATCH of the file.
+bool SavePatchable(size_t *changed)
+{
+	size_t off = 0, j;
+
+	*changed = 0;
+	if (Save.base == NULL || Save.total != Save.basesize)
+		return false;
+	for (j = 0; j < Save.count; j++)
+	{
+		struct savedline *line = &Save.line[j];
+		bool last = j + 1 == Save.count;
+		if (!SaveInFile(line->bytes))
+			*changed += line->size + !last;
+		else if (line->bytes != Save.base + off || (!last && line->bytes[line->size] != '\n'))
+			return false;
+		off += line->size + 1;
+	}
+	return *changed <= Save.total / KILO_SAVE_PATCH;
+}
+
+// Header of the patch an in-place save leaves in its copy file until the
+// file is patched. Runs follow, each an offset and a length as uint64_t
+// and the bytes written there.
+typedef struct savepatch {
+	char magic[4];	// Only set once the runs are all written.
+	uint32_t sum;	// SaveHash of the runs.
+	uint64_t size;	// Size of the file.
+} savepatch_t;
+
+// FNV-1a of s carrying on from h, so that hashing in pieces gives the
+// same result. Start from 2166136261.
+uint32_t SaveHash(uint32_t h, const char *s, size_t len)
+{
+	for (size_t j = 0; j < len; j++)
+	{
+		h ^= (unsigned char)s[j];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+// Goes through the runs of changed lines. With a log, appends each run to
+// it and adds it to sum. Without, writes each run over fp where it goes.
+bool SavePatchRuns(FILE *fp, bool log, uint32_t *sum)
+{
+	size_t off = 0, j = 0, k;
+
+	while (j < Save.count)
+	{
+		if (SaveInFile(Save.line[j].bytes))
+		{
+			off += Save.line[j].size + 1;
+			j++;
+			continue;
+		}
+
+		uint64_t run[2] = { off, 0 };
+		for (k = j; k < Save.count && !SaveInFile(Save.line[k].bytes); k++)
+			run[1] += Save.line[k].size + (k + 1 < Save.count);
+		if (log)
+		{
+			fwrite(run, sizeof(run), 1, fp);
+			*sum = SaveHash(*sum, (char *)run, sizeof(run));
+		}
+		else if (!FileSeek(fp, off))
+		{
+			return false;
+		}
+		for (; j < k; j++)
+		{
+			struct savedline *line = &Save.line[j];
+			fwrite(line->bytes, 1, line->size, fp);
+			if (log)
+				*sum = SaveHash(*sum, line->bytes, line->size);
+			if (j + 1 < Save.count)
+			{
+				fputc('\n', fp);
+				if (log)
+					*sum = SaveHash(*sum, "\n", 1);
+			}
+		}
+		off += run[1];
+	}
+	return !ferror(fp);
+}
+
+// Opens the file being saved, or returns NULL unless it is still the file
+// that was mapped. Another program may have replaced it meanwhile, and then
+// the mapping no longer matches what the path names.
+FILE *SaveOpenFile(const char *mode)
+{
+	fileid_t id;
+	FILE *fp = fopen(E.filename, mode);
+
+	if (fp != NULL && (!FileId(fp, &id) || memcmp(&id, &Save.baseid, sizeof(id))))
+	{
+		fclose(fp);
+		fp = NULL;
+	}
+	return fp;
+}
+
+// Patches file, opened for update, in place and closes it. The patch goes
+// to the copy file first and is synced before the file is touched, so that
+// a patch cut short is finished when the file is next opened.
+bool SavePatch(FILE *file)
+{
+	savepatch_t head;
+	FILE *fp = fopen(Save.tmp, "wb");
+	if (fp == NULL)
+	{
+		fclose(file);
+		return false;
+	}
+
+	memset(&head, 0, sizeof(head));
+	head.sum = 2166136261u;
+	head.size = Save.total;
+	bool ok = fwrite(&head, sizeof(head), 1, fp) == 1 && SavePatchRuns(fp, true, &head.sum) && fflush(fp) == 0;
+	if (ok)
+	{
+		FileSync(fp);
+		memcpy(head.magic, "WKP1", 4);
+		ok = FileSeek(fp, 0) && fwrite(&head, sizeof(head), 1, fp) == 1 && fflush(fp) == 0;
+	}
+	if (ok)
+		FileSync(fp);
+	ok = (fclose(fp) == 0) && ok;
+	if (!ok)
+	{
+		fclose(file);
+		remove(Save.tmp);
+		return false;
+	}
+
+	ok = SavePatchRuns(file, false, NULL) && fflush(file) == 0;
+	if (ok)
+	{
+		FileSync(file);
+		FileId(file, &Save.baseid);
+	}
+	ok = (fclose(file) == 0) && ok;
+	if (ok)
+		remove(Save.tmp);
+	return ok;
+}
+
+// Reads the runs of a patch, checking them against head. With fp, writes
+// them over it as well. Whether the runs add up to head.sum.
+bool SavePatchReplay(FILE *log, FILE *fp, savepatch_t *head)
+{
+	char *buf = malloc(KILO_SAVE_BUFFER);
+	uint32_t sum = 2166136261u;
+	uint64_t run[2];
+	bool ok = buf != NULL;
+
+	while (ok && fread(run, sizeof(run), 1, log) == 1)
+	{
+		sum = SaveHash(sum, (char *)run, sizeof(run));
+		ok = run[0] <= head->size && run[1] <= head->size - run[0] && (!fp || FileSeek(fp, run[0]));
+		while (ok && run[1] > 0)
+		{
+			size_t n = run[1] < KILO_SAVE_BUFFER ? (size_t)run[1] : KILO_SAVE_BUFFER;
+			ok = fread(buf, 1, n, log) == n && (!fp || fwrite(buf, 1, n, fp) == n);
+			sum = SaveHash(sum, buf, n);
+			run[1] -= n;
+		}
+	}
+	free(buf);
+	return ok && sum == head->sum;
+}
+
+// Finishes an in-place save of filename that was cut short, from the patch
+// left in its copy file. A patch not fully written is dropped, as the file
+// wasn't touched yet. A full copy left behind stays as it is.
+void SavePatchRecover(char *filename)
+{
+	filename = FileResolve(filename);
+	size_t len = strlen(filename);
+	char *tmp = malloc(len + sizeof(KILO_SAVE_SUFFIX));
+	savepatch_t head;
+
+	memcpy(tmp, filename, len);
+	memcpy(&tmp[len], KILO_SAVE_SUFFIX, sizeof(KILO_SAVE_SUFFIX));
+	FILE *log = fopen(tmp, "rb");
+	if (log == NULL)
+	{
+		free(tmp);
+		free(filename);
+		return;
+	}
+
+	bool patch = fread(&head, sizeof(head), 1, log) == 1 && !memcmp(head.magic, "WKP1", 4);
+	if (patch && SavePatchReplay(log, NULL, &head))
+	{
+		FILE *fp = fopen(filename, "r+b");
+		bool ok = fp != NULL && FileSeek(log, sizeof(head)) && SavePatchReplay(log, fp, &head) && fflush(fp) == 0;
+		if (ok)
+			FileSync(fp);
+		if (fp)
+			ok = (fclose(fp) == 0) && ok;
+		patch = ok;
+	}
+	fclose(log);
+	if (patch)
+		remove(tmp);
+	free(tmp);
+	free(filename);
+}
+
+// Writer thread. Unless the file can be patched in place, the text goes
+// to a copy next to the file first, so that a failure or a crash halfway
+// leaves the file as it was. A file replaced since it was mapped is never
+// patched or copied from: the text is written out in full.
+void SaveWrite(void *arg)
+{
+	bool ok = false;
+	FILE *file = NULL;
+
+	Save.patched = SavePatchable(&Save.changed) && (file = SaveOpenFile("r+b")) != NULL;
+	if (Save.patched)
+	{
+		ok = SavePatch(file);
+	}
+	else
+	{
+		FILE *fp = fopen(Save.tmp, "wb");
+		FILE *in = Save.base ? SaveOpenFile("rb") : NULL;
+		if (fp != NULL)
+		{
+			setvbuf(fp, NULL, _IONBF, 0);
+			ok = SaveWriteLines(fp, in) && fflush(fp) == 0;
+			if (ok)
+				FileSync(fp);
+			ok = (fclose(fp) == 0) && ok;
+		}
+		if (in != NULL)
+			fclose(in);
+	}
+
+	MutexLock(&Save.lock);
+	Save.error = ok ? 0 : errno;
+	Save.ok = ok;
+	Save.done = true;
+	if (ok)
+		Save.written = Save.total;
+	MutexUnlock(&Save.lock);
+}
+
+// Maps filename read-only into E.base. Empty files leave E.base NULL.
+#ifdef _WIN32
+int EditorMapFile(char *filename)
+{
+	LARGE_INTEGER size;
+	HANDLE hFile = CreateFile(
+		filename,
+		GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL
+	);
+
+	if (hFile == INVALID_HANDLE_VALUE)
+		return 0;
+
+	if (!GetFileSizeEx(hFile, &size))
+	{
+		CloseHandle(hFile);
+		return 0;
+	}
+
+	E.base = NULL;
+	E.basesize = 0;
+	E.basemapped = false;
+
+	if (size.QuadPart > 0)
+	{
+		HANDLE hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (hMap != NULL)
+		{
+			E.base = MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+			// The view keeps its own reference to the mapping.
+			CloseHandle(hMap);
+		}
+		if (E.base == NULL)
+		{
+			CloseHandle(hFile);
+			return 0;
+		}
+		E.basesize = (size_t)size.QuadPart;
+		E.basemapped = true;
+		FileHandleId(hFile, &E.baseid);
+	}
+
+	// The mapping keeps its own reference to the file.
+	CloseHandle(hFile);
+	return 1;
+}
+#else
+int EditorMapFile(char *filename)
+{
+	struct stat st;
+	int fd = open(filename, O_RDONLY);
+
+	if (fd == -1)
+		return 0;
+
+	if (fstat(fd, &st) == -1)
+	{
+		close(fd);
+		return 0;
+	}
+
+	E.base = NULL;
+	E.basesize = 0;
+	E.basemapped = false;
+
+	if (st.st_size > 0)
+	{
+		void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (base == MAP_FAILED)
+		{
+			close(fd);
+			return 0;
+		}
+		E.base = base;
+		E.basesize = (size_t)st.st_size;
+		E.basemapped = true;
+		FileDescId(fd, &E.baseid);
+	}
+
+	// The mapping keeps its own reference to the file.
+	close(fd);
+	return 1;
+}
+#endif
+
+void EditorUnmapFile(void)
+{
+	if (E.basemapped)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(E.base);
+#else
+		munmap(E.base, E.basesize);
+#endif
+	}
+	else
+	{
+		free(E.base);
+	}
+	E.base = NULL;
+	E.basesize = 0;
+	E.basemapped = false;
+}
+
+// Whether p points into E.base, or right past its end for an empty last line.
+bool EditorInBase(const char *p)
+{
+	return (uintptr_t)p - (uintptr_t)E.base <= E.basesize;
+}
+
+// Ends the borrowing of the lines from the save. With base, which holds
+// what was written, every line still borrowing is as it was saved and
+// moves there. Without, the lines borrowing heap bytes take them back.
+// Bytes no line uses any more are freed.
+void SaveRelease(char *base)
+{
+	size_t j, k = 0, off = 0;
+
+	for (j = 0; j < E.linesnum; j++)
+	{
+		line_t *line = EditorLine(j);
+		if (!line->mapped) continue;
+
+		// Edits never reorder lines, so the saved ones follow each other.
+		while (k < Save.count && Save.line[k].bytes != line->bytes)
+		{
+			off += Save.line[k].size + 1;
+			k++;
+		}
+		if (k == Save.count)
+			break;
+		if (base)
+		{
+			line->bytes = base + off;
+		}
+		else if (!EditorInBase(line->bytes))
+		{
+			line->mapped = false;
+			Save.line[k].bytes = NULL;
+		}
+	}
+	for (k = 0; k < Save.count; k++)
+	{
+		if (Save.line[k].bytes && !EditorInBase(Save.line[k].bytes))
+			LineFree(Save.line[k].bytes, Save.line[k].size + 1);
+	}
+	free(Save.line);
+	Save.line = NULL;
+	Save.count = 0;
+}
+
+/*** Line Index ***/
+
+// Newline offsets found in one slice of the file, relative to its start.
+typedef struct nlindex {
+	uint32_t *off;
+	size_t count;
+	size_t cap;
+} nlindex_t;
+
+void NlPush(nlindex_t *ix, size_t off)
+{
+	if (ix->count == ix->cap)
+	{
+		ix->cap = ix->cap ? ix->cap * 2 : 4096;
+		ix->off = realloc(ix->off, sizeof(uint32_t) * ix->cap);
+	}
+	ix->off[ix->count++] = (uint32_t)off;
+}
+
+void ScanNewlinesScalar(const char *p, size_t len, nlindex_t *ix)
+{
+	const char *s = p, *end = p + len, *nl;
+	while (s < end && (nl = memchr(s, '\n', end - s)) != NULL)
+	{
+		NlPush(ix, nl - p);
+		s = nl + 1;
+	}
+}
+
+#if KILO_X86
+void ScanNewlinesSSE2(const char *p, size_t len, nlindex_t *ix)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		while (mask)
+		{
+			NlPush(ix, i + CountTrailingZeros(mask));
+			mask &= mask - 1;
+		}
+	}
+	for (; i < len; i++)
+		if (p[i] == '\n')
+			NlPush(ix, i);
+}
+
+KILO_TARGET_AVX2
+void ScanNewlinesAVX2(const char *p, size_t len, nlindex_t *ix)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	size_t i = 0;
+
+	// Two vectors per step so long lines skip 64 bytes per test.
+	for (; i + 64 <= len; i += 64)
+	{
+		__m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), nl);
+		__m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + 32)), nl);
+		if (_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_or_si256(a, b)))
+			continue;
+
+		unsigned int mask = _mm256_movemask_epi8(a);
+		while (mask)
+		{
+			NlPush(ix, i + CountTrailingZeros(mask));
+			mask &= mask - 1;
+		}
+		mask = _mm256_movemask_epi8(b);
+		while (mask)
+		{
+			NlPush(ix, i + 32 + CountTrailingZeros(mask));
+			mask &= mask - 1;
+		}
+	}
+	for (; i < len; i++)
+		if (p[i] == '\n')
+			NlPush(ix, i);
+}
+#endif
+
+struct NewlineScanner {
+	char *name;
+	void (*scan)(const char *p, size_t len, nlindex_t *ix);
+} NLSCANNERS[] = {
+	{ "scalar", ScanNewlinesScalar },
+#if KILO_X86
+	{ "sse2", ScanNewlinesSSE2 },
+	{ "avx2", ScanNewlinesAVX2 },
+#endif
+};
+
+#define NLSCANNERS_ENTRIES (sizeof(NLSCANNERS) / sizeof(NLSCANNERS[0]))
+
+int NewlineScannerSupported(struct NewlineScanner *s)
+{
+	return strcmp(s->name, "avx2") || CpuHasAVX2();
+}
+
+// Picks the widest scanner the CPU supports.
+struct NewlineScanner *NewlineScanner(void)
+{
+	static struct NewlineScanner *best = NULL;
+
+	if (best == NULL)
+	{
+		for (unsigned int j = 0; j < NLSCANNERS_ENTRIES; j++)
+			if (NewlineScannerSupported(&NLSCANNERS[j]))
+				best = &NLSCANNERS[j];
+	}
+	return best;
+}
+
+// Points line at len bytes of the mapping. An empty file has no mapping,
+// so its line points at empty instead, as line bytes are never NULL.
+void EditorInitMappedLine(line_t *line, char *p, size_t len)
+{
+	static char empty[1];
+
+	while (len > 0 && p[len - 1] == '\r')
+		len--;
+
+	line->size = len;
+	line->bytes = p ? p : empty;
+	line->disp = 0;
+	line->hl_open_comment = 0;
+	line->hl_entry = -1;
+	line->mapped = true;
+}
+
+// One slice of E.base. Slices are scanned for newlines in parallel, then
+// stitched together by line number and turned into lines in parallel.
+typedef struct indexjob {
+	char *start;
+	size_t len;
+	nlindex_t nl;
+	void (*scan)(const char *p, size_t len, nlindex_t *ix);
+	line_t *lines;		// Slots for the lines ending in this slice.
+	char *first;		// Start of the first line ending in this slice.
+	thread_t thread;
+	bool started;		// Runs on thread, else on the caller after the others.
+} indexjob_t;
+
+void IndexJobScan(void *arg)
+{
+	indexjob_t *job = arg;
+	job->scan(job->start, job->len, &job->nl);
+}
+
+void IndexJobFill(void *arg)
+{
+	indexjob_t *job = arg;
+	char *p = job->first;
+
+	for (size_t j = 0; j < job->nl.count; j++)
+	{
+		char *nl = job->start + job->nl.off[j];
+		EditorInitMappedLine(&job->lines[j], p, nl - p);
+		p = nl + 1;
+	}
+}
+
+void IndexJobsRun(indexjob_t *jobs, int njobs, void (*fn)(void *))
+{
+	int j;
+	for (j = 1; j < njobs; j++)
+		jobs[j].started = ThreadStart(&jobs[j].thread, fn, &jobs[j]);
+	fn(&jobs[0]);
+	for (j = 1; j < njobs; j++)
+	{
+		if (jobs[j].started)
+			ThreadJoin(&jobs[j].thread);
+		else
+			fn(&jobs[j]);
+	}
+}
+
+// Splits base into lines appended after the existing ones, without copying
+// the bytes. Render and hl are left for EditorLineDisplay so only the lines
+// that get drawn pay for them. Returns the number of lines added.
+size_t EditorIndexBuffer(char *base, size_t size, struct NewlineScanner *scanner, int threads)
+{
+	indexjob_t jobs[KILO_MAX_THREADS];
+	int njobs = (int)(size / KILO_INDEX_CHUNK);
+	size_t total = 0;
+	int j;
+
+	if (njobs > threads) njobs = threads;
+	if (njobs < 1) njobs = 1;
+	// Offsets are 32 bits wide, so no slice may reach 4 GB.
+	while (size / njobs >= UINT32_MAX && njobs < KILO_MAX_THREADS)
+		njobs++;
+
+	for (j = 0; j < njobs; j++)
+	{
+		size_t from = size / njobs * j;
+		size_t to = (j == njobs - 1) ? size : size / njobs * (j + 1);
+		jobs[j].start = base + from;
+		jobs[j].len = to - from;
+		jobs[j].nl.off = NULL;
+		jobs[j].nl.count = 0;
+		jobs[j].nl.cap = 0;
+		jobs[j].scan = scanner->scan;
+	}
+	IndexJobsRun(jobs, njobs, IndexJobScan);
+
+	for (j = 0; j < njobs; j++)
+		total += jobs[j].nl.count;
+
+	size_t at = E.linesnum;
+	EditorGrowLines(total + 1);
+	EditorMoveGap(at);
+
+	char *first = base;
+	line_t *lines = &E.line[at];
+	for (j = 0; j < njobs; j++)
+	{
+		jobs[j].lines = lines;
+		jobs[j].first = first;
+		if (jobs[j].nl.count)
+			first = jobs[j].start + jobs[j].nl.off[jobs[j].nl.count - 1] + 1;
+		lines += jobs[j].nl.count;
+	}
+	IndexJobsRun(jobs, njobs, IndexJobFill);
+
+	// Whatever follows the last newline is the final line.
+	EditorInitMappedLine(lines, first, size - (size_t)(first - base));
+
+	for (j = 0; j < njobs; j++)
+		free(jobs[j].nl.off);
+
+	E.gap += total + 1;
+	E.linesnum += total + 1;
+	return total + 1;
+}
+
+void EditorIndexLines(void)
+{
+	EditorIndexBuffer(E.base, E.basesize, NewlineScanner(), ThreadCount());
+}
+
+// Whether a record read back from a journal fits the text.
+bool EditorUndoValid(undo_t *u)
+{
+	if (u->y < 0 || u->x < 0)
+		return false;
+	switch (u->op)
+	{
+		case UNDO_INSERT_TEXT:
+		case UNDO_DELETE_TEXT:
+		case UNDO_SPLIT:
+			return u->y < E.linesnum;
+		case UNDO_JOIN:
+			return u->y + 1 < E.linesnum;
+		case UNDO_INSERT_LINES:
+			return u->y <= E.linesnum;
+		case UNDO_DELETE_LINES:
+			return u->y + u->x <= E.linesnum;
+	}
+	return false;
+}
+
+// Replays the edits left in the journal of the file just opened, when they
+// were made to the same contents, and starts the journal over with them.
+void EditorRecover(void)
+{
+	size_t len = strlen(E.filename), size = 0, off;
+	char *path = malloc(len + sizeof(KILO_JOURNAL_SUFFIX));
+	char *old = NULL;
+	int count = 0;
+
+	memcpy(path, E.filename, len);
+	memcpy(&path[len], KILO_JOURNAL_SUFFIX, sizeof(KILO_JOURNAL_SUFFIX));
+	FILE *fp = fopen(path, "rb");
+	if (fp)
+	{
+		size_t cap = 0, n;
+		do
+		{
+			if (size == cap)
+			{
+				cap = cap ? cap * 2 : 65536;
+				old = realloc(old, cap);
+			}
+			n = fread(&old[size], 1, cap - size, fp);
+			size += n;
+		} while (n > 0);
+		fclose(fp);
+	}
+	free(path);
+	JournalReset();
+	if (old == NULL)
+		return;
+
+	journalhead_t head;
+	JournalHead(&head);
+	if (size < sizeof(head) || memcmp(old, &head, sizeof(head)))
+	{
+		if (size > sizeof(head))
+			EditorSetStatusMessage("Journal of %s is for other contents, discarded", E.filename);
+		free(old);
+		return;
+	}
+
+	for (off = sizeof(head); off + sizeof(undo_t) <= size; off += UndoSize(((undo_t *)&old[off])->len))
+	{
+		undo_t *u = (undo_t *)&old[off];
+		if (u->len > size - off - sizeof(undo_t) || JournalChecksum(u, (char *)(u + 1)) != u->prev ||
+			!EditorUndoValid(u))
+			break;
+		EditorUndoApply(u, false);
+		count++;
+	}
+	free(old);
+	if (count)
+		EditorSetStatusMessage("Recovered %d unsaved edits from the journal", count);
+}
+
+void EditorOpen(char *filename)
+{
+	double t = ClockNow();
+	free(E.filename);
+	E.filename = strdup(filename);
+
+	EditorSelectSyntaxHighlight();
+	SavePatchRecover(filename);
+
+	if (!EditorMapFile(filename))
+	{
+		fprintf(stderr, "File Open: Can't map %s (%d).\n", filename, LastError());
+		getchar();
+		exit(1);
+	}
+
+	EditorIndexLines();
+	E.dirty = 0;
+	UndoReset();
+	EditorRecover();
+	PerfEnd(PERF_OPEN, t);
+}
+
+// Whether the mapping of the file shows what was patched in place, which
+// a mapping isn't bound to everywhere.
+bool SavePatchShown(void)
+{
+	size_t off = 0, j;
+
+	for (j = 0; j < Save.count; j++)
+	{
+		struct savedline *line = &Save.line[j];
+		if (!SaveInFile(line->bytes) && memcmp(Save.base + off, line->bytes, line->size))
+			return false;
+		off += line->size + 1;
+	}
+	return true;
+}
+
+// Takes over once the writer is done: the lines borrow from what was
+// written from then on. A copy is mapped, which lets the old file go
+// before the copy takes its place; a file patched in place is usually
+// mapped already. The file is only unmodified if nothing was edited
+// meanwhile.
+void EditorSaveDone(void)
+{
+	char *base = E.base;
+	size_t basesize = E.basesize;
+	bool basemapped = E.basemapped;
+	fileid_t baseid = E.baseid;
+	bool ok = Save.ok, remap = !Save.patched || !SavePatchShown();
+	char *path = Save.patched ? E.filename : Save.tmp;
+
+	if (!ok)
+	{
+		EditorSetStatusMessage("Can't save! I/O error: %s", strerror(Save.error));
+	}
+	else if (remap)
+	{
+		ok = EditorMapFile(path);
+		if (ok && E.basesize != Save.total)
+		{
+			EditorUnmapFile();
+			ok = false;
+		}
+		if (!ok)
+			EditorSetStatusMessage("Can't save! Can't map %s (%d)", path, LastError());
+	}
+	char *newbase = E.base;
+	bool newmapped = E.basemapped;
+	fileid_t newid = remap ? E.baseid : Save.baseid;
+	E.base = base;
+	E.basesize = basesize;
+	E.basemapped = basemapped;
+	E.baseid = baseid;
+	if (!ok)
+	{
+		SaveRelease(NULL);
+		if (!Save.patched)
+			remove(Save.tmp);
+		free(Save.tmp);
+		free(Save.target);
+		JournalKeep(false);
+		PerfEnd(PERF_SAVE, Save.start);
+		return;
+	}
+
+	SaveRelease(newbase);
+	if (remap)
+	{
+		EditorUnmapFile();
+		E.base = newbase;
+		E.basesize = Save.total;
+		E.basemapped = newmapped;
+	}
+	E.baseid = newid;
+
+	if (!Save.patched && !FileReplace(Save.tmp, Save.target))
+	{
+		EditorSetStatusMessage("Can't save! Rename failed (%d), the text is in %s", LastError(), Save.tmp);
+		free(Save.tmp);
+		free(Save.target);
+		JournalKeep(false);
+		PerfEnd(PERF_SAVE, Save.start);
+		return;
+	}
+	free(Save.tmp);
+	free(Save.target);
+	if (Undo.edits == Save.edits)
+	{
+		E.dirty = 0;
+		Undo.clean = Undo.at;
+	}
+	else
+	{
+		if (!E.dirty)
+			E.dirty = 1;
+		Undo.clean = SIZE_MAX;
+	}
+	if (Save.patched)
+		EditorSetStatusMessage("%zu bytes written in place", Save.changed);
+	else
+		EditorSetStatusMessage("%zu bytes written to disk", Save.total);
+	JournalReset();
+	JournalKeep(false);
+	PerfEnd(PERF_SAVE, Save.start);
+}
+
+// Finishes the save in progress once the writer is done, or waits for it.
+void EditorSaveFinish(bool wait)
+{
+	if (!Save.running) return;
+
+	MutexLock(&Save.lock);
+	bool done = Save.done;
+	MutexUnlock(&Save.lock);
+	if (!done && !wait) return;
+
+	ThreadJoin(&Save.thread);
+	Save.running = false;
+	EditorSaveDone();
+}
+
+// Percentage of the save in progress written so far.
+int EditorSaveProgress(void)
+{
+	MutexLock(&Save.lock);
+	int percent = Save.total ? (int)(Save.written * 100 / Save.total) : 100;
+	MutexUnlock(&Save.lock);
+	return percent;
+}
+
+// Hands the text as it stands to the writer thread. Copying the line slots
+// is all it costs: the lines lend their bytes to the save.
+void EditorSave(void)
+{
+	if (Save.running)
+	{
+		EditorSetStatusMessage("Still saving, %d%% written", EditorSaveProgress());
+		return;
+	}
+	if (E.filename == NULL)
+	{
+		E.filename = EditorPrompt("Save as: %s (ESC to cancel)", NULL, false);
+		if (E.filename == NULL)
+		{
+			EditorSetStatusMessage("Save aborted");
+			return;
+		}
+		EditorSelectSyntaxHighlight();
+	}
+
+	Save.start = ClockNow();
+	Save.line = PerfMalloc(E.linesnum * sizeof(*Save.line));
+	if (Save.line == NULL && E.linesnum)
+	{
+		EditorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+		PerfEnd(PERF_SAVE, Save.start);
+		return;
+	}
+
+	Save.target = FileResolve(E.filename);
+	size_t len = strlen(Save.target), total = 0, j;
+	Save.tmp = malloc(len + sizeof(KILO_SAVE_SUFFIX));
+	memcpy(Save.tmp, Save.target, len);
+	memcpy(&Save.tmp[len], KILO_SAVE_SUFFIX, sizeof(KILO_SAVE_SUFFIX));
+
+	for (j = 0; j < E.linesnum; j++)
+	{
+		line_t *line = EditorLine(j);
+		Save.line[j].bytes = line->bytes;
+		Save.line[j].size = line->size;
+		line->mapped = true;
+		total += line->size + 1;
+	}
+	Save.count = E.linesnum;
+	Save.total = total ? total - 1 : 0;
+	Save.base = E.basemapped ? E.base : NULL;
+	Save.basesize = E.basesize;
+	Save.baseid = E.baseid;
+	Save.written = 0;
+	Save.edits = Undo.edits;
+	Save.ok = false;
+	Save.done = false;
+	JournalKeep(true);
+
+	Save.running = ThreadStart(&Save.thread, SaveWrite, NULL);
+	if (!Save.running)
+	{
+		SaveWrite(NULL);
+		EditorSaveDone();
+	}
+}
+
+/*** Regex ***/
+
+// Regular expressions with literals, ., [classes] with ranges and ^, the
+// escapes \d \w \s and their capitals, ^ and $ at line boundaries, ( ), |
+// and the quantifiers * + ?. A pattern compiles to a Thompson NFA testing
+// bytes against 256 bit sets. ReScan runs a DFA built lazily from the NFA
+// over whole blocks of lines to find where a first match ends, and ReMatch
+// simulates the NFA over that line for the leftmost longest match, so both
+// take linear time. Line breaks never match, so no match spans two lines;
+// empty matches are ignored.
+enum ReOp {
+	RE_SET,		// Consumes a byte in sets[set].
+	RE_SPLIT,	// Goes on at both out and out1.
+	RE_JMP,		// Goes on at out.
+	RE_BOL,		// Goes on at out at the start of a line.
+	RE_EOL,		// Goes on at out at the end of a line.
+	RE_MATCH
+};
+
+typedef struct restate {
+	int op;
+	int out;
+	int out1;
+	int set;
+} restate_t;
+
+struct Regex {
+	restate_t *st;
+	int nst;
+	int stcap;
+	uint32_t (*sets)[8];
+	int nsets;
+	int setcap;
+	int start;
+	bool icase;
+	const char *p;		// Parse position.
+	const char *error;
+};
+
+// Lazily built DFA and scratch space for one thread matching a Regex. A DFA
+// state is the set of NFA states reached after consuming a byte, kept in
+// pool, and whether it sits at a line start.
+typedef struct dstate {
+	int off;		// First NFA state in pool.
+	int n;
+	bool bol;
+	bool match;		// A match ends here.
+	signed char eolmatch;	// A match ends here before a line break, -1 unknown.
+	int next[256];		// DFA state after each byte times 2, plus 1 if the byte
+				// ends a line or a match; -1 unknown.
+} dstate_t;
+
+struct ReCache {
+	struct Regex *re;
+	dstate_t *ds;
+	int nds;
+	int dscap;
+	int *pool;
+	int poollen;
+	int poolcap;
+	int *hash;		// DFA states by their NFA state sets, -1 for empty slots.
+	int hashcap;
+	int *list;		// Scratch lists of NFA states, and their starts.
+	int *list2;
+	int *starts;
+	int *starts2;
+	int *stack;
+	unsigned int *mark;
+	unsigned int gen;
+	int idle;		// DFA state with no match under way, -1 until built.
+	bool skip[256];		// Bytes leaving idle where it is.
+};
+
+#define RE_TERM(c) ((c) == '\n' || (c) == '\r')
+
+int ReState(struct Regex *re, int op, int out, int out1)
+{
+	if (re->nst == re->stcap)
+	{
+		re->stcap = re->stcap ? re->stcap * 2 : 64;
+		re->st = realloc(re->st, sizeof(restate_t) * re->stcap);
+	}
+	restate_t *s = &re->st[re->nst];
+	s->op = op;
+	s->out = out;
+	s->out1 = out1;
+	s->set = -1;
+	return re->nst++;
+}
+
+int ReNewSet(struct Regex *re)
+{
+	if (re->nsets == re->setcap)
+	{
+		re->setcap = re->setcap ? re->setcap * 2 : 16;
+		re->sets = realloc(re->sets, sizeof(*re->sets) * re->setcap);
+	}
+	memset(re->sets[re->nsets], 0, sizeof(*re->sets));
+	return re->nsets++;
+}
+
+void ReSetAdd(struct Regex *re, int set, int c)
+{
+	re->sets[set][c >> 5] |= 1u << (c & 31);
+	if (re->icase && isalpha(c))
+	{
+		int o = islower(c) ? toupper(c) : tolower(c);
+		re->sets[set][o >> 5] |= 1u << (o & 31);
+	}
+}
+
+bool ReSetHas(struct Regex *re, int set, int c)
+{
+	return (re->sets[set][c >> 5] >> (c & 31)) & 1;
+}
+
+// A fragment of the NFA being built: its first state and a list of the
+// outs still to be patched, threaded through the outs themselves. An out
+// is numbered state * 2 + (0 for out, 1 for out1).
+typedef struct refrag {
+	int start;
+	int outs;
+} refrag_t;
+
+int *ReOut(struct Regex *re, int id)
+{
+	return (id & 1) ? &re->st[id >> 1].out1 : &re->st[id >> 1].out;
+}
+
+void RePatch(struct Regex *re, int outs, int to)
+{
+	while (outs != -1)
+	{
+		int *p = ReOut(re, outs);
+		outs = *p;
+		*p = to;
+	}
+}
+
+int ReAppend(struct Regex *re, int a, int b)
+{
+	if (a == -1) return b;
+	int id = a;
+	while (*ReOut(re, id) != -1)
+		id = *ReOut(re, id);
+	*ReOut(re, id) = b;
+	return a;
+}
+
+refrag_t ReSingle(struct Regex *re, int op)
+{
+	int s = ReState(re, op, -1, -1);
+	refrag_t f = { s, s * 2 };
+	return f;
+}
+
+// Adds the bytes of \d \w \s and their negations to set.
+bool ReClassEscape(struct Regex *re, int set, int e)
+{
+	int c;
+	bool neg = isupper(e);
+
+	switch (tolower(e))
+	{
+		case 'd': case 'w': case 's':
+			for (c = 0; c < 256; c++)
+			{
+				bool in = (tolower(e) == 'd') ? isdigit(c) :
+					(tolower(e) == 'w') ? (isalnum(c) || c == '_') : isspace(c);
+				if (in != neg)
+					ReSetAdd(re, set, c);
+			}
+			return true;
+	}
+	return false;
+}
+
+int ReEscapeByte(int e)
+{
+	switch (e)
+	{
+		case 't': return '\t';
+		case 'n': return '\n';
+		case 'r': return '\r';
+		default: return e;
+	}
+}
+
+refrag_t ReParseAlt(struct Regex *re);
+
+refrag_t ReParseAtom(struct Regex *re)
+{
+	refrag_t f = { -1, -1 };
+	int c = (unsigned char)*re->p++;
+
+	switch (c)
+	{
+		case '(':
+			f = ReParseAlt(re);
+			if (*re->p != ')')
+			{
+				re->error = "missing )";
+				return f;
+			}
+			re->p++;
+			return f;
+		case '^':
+			return ReSingle(re, RE_BOL);
+		case '$':
+			return ReSingle(re, RE_EOL);
+		case '*': case '+': case '?':
+			re->error = "nothing to repeat";
+			return f;
+		case '\\':
+			if (*re->p == '\0')
+			{
+				re->error = "trailing \\";
+				return f;
+			}
+			f = ReSingle(re, RE_SET);
+			re->st[f.start].set = ReNewSet(re);
+			c = (unsigned char)*re->p++;
+			if (!ReClassEscape(re, re->st[f.start].set, c))
+				ReSetAdd(re, re->st[f.start].set, ReEscapeByte(c));
+			break;
+		case '.':
+			f = ReSingle(re, RE_SET);
+			re->st[f.start].set = ReNewSet(re);
+			for (c = 0; c < 256; c++)
+				ReSetAdd(re, re->st[f.start].set, c);
+			break;
+		case '[':
+		{
+			int set = ReNewSet(re);
+			bool neg = (*re->p == '^');
+			if (neg) re->p++;
+			// A ] first in the class stands for itself.
+			do
+			{
+				if (*re->p == '\0')
+				{
+					re->error = "missing ]";
+					return f;
+				}
+				int lo = (unsigned char)*re->p++;
+				if (lo == '\\' && *re->p)
+				{
+					if (ReClassEscape(re, set, (unsigned char)*re->p++))
+						continue;
+					lo = ReEscapeByte((unsigned char)re->p[-1]);
+				}
+				int hi = lo;
+				if (re->p[0] == '-' && re->p[1] && re->p[1] != ']')
+				{
+					hi = (unsigned char)re->p[1];
+					re->p += 2;
+					if (hi == '\\' && *re->p)
+						hi = ReEscapeByte((unsigned char)*re->p++);
+				}
+				for (c = lo; c <= hi; c++)
+					ReSetAdd(re, set, c);
+			} while (*re->p != ']');
+			re->p++;
+			if (neg)
+				for (c = 0; c < 8; c++)
+					re->sets[set][c] = ~re->sets[set][c];
+			f = ReSingle(re, RE_SET);
+			re->st[f.start].set = set;
+			break;
+		}
+		default:
+			f = ReSingle(re, RE_SET);
+			re->st[f.start].set = ReNewSet(re);
+			ReSetAdd(re, re->st[f.start].set, c);
+			break;
+	}
+	// Line breaks never match.
+	uint32_t *set = re->sets[re->st[f.start].set];
+	set['\n' >> 5] &= ~(1u << ('\n' & 31));
+	set['\r' >> 5] &= ~(1u << ('\r' & 31));
+	return f;
+}
+
+refrag_t ReParseRepeat(struct Regex *re)
+{
+	refrag_t f = ReParseAtom(re);
+
+	while (!re->error && (*re->p == '*' || *re->p == '+' || *re->p == '?'))
+	{
+		int s = ReState(re, RE_SPLIT, f.start, -1);
+		switch (*re->p++)
+		{
+			case '*':
+				RePatch(re, f.outs, s);
+				f.start = s;
+				f.outs = s * 2 + 1;
+				break;
+			case '+':
+				RePatch(re, f.outs, s);
+				f.outs = s * 2 + 1;
+				break;
+			case '?':
+				f.start = s;
+				f.outs = ReAppend(re, f.outs, s * 2 + 1);
+				break;
+		}
+	}
+	return f;
+}
+
+refrag_t ReParseConcat(struct Regex *re)
+{
+	refrag_t f = ReSingle(re, RE_JMP);
+
+	while (!re->error && *re->p && *re->p != '|' && *re->p != ')')
+	{
+		refrag_t g = ReParseRepeat(re);
+		if (re->error) break;
+		RePatch(re, f.outs, g.start);
+		f.outs = g.outs;
+	}
+	return f;
+}
+
+refrag_t ReParseAlt(struct Regex *re)
+{
+	refrag_t f = ReParseConcat(re);
+
+	while (!re->error && *re->p == '|')
+	{
+		re->p++;
+		refrag_t g = ReParseConcat(re);
+		int s = ReState(re, RE_SPLIT, f.start, g.start);
+		f.start = s;
+		f.outs = ReAppend(re, f.outs, g.outs);
+	}
+	return f;
+}
+
+void ReFree(struct Regex *re)
+{
+	if (re == NULL) return;
+	free(re->st);
+	free(re->sets);
+	free(re);
+}
+
+// Compiles pattern, or returns NULL and sets *error.
+struct Regex *ReCompile(const char *pattern, bool icase, const char **error)
+{
+	struct Regex *re = calloc(1, sizeof(*re));
+
+	re->icase = icase;
+	re->p = pattern;
+	refrag_t f = ReParseAlt(re);
+	if (!re->error && *re->p == ')')
+		re->error = "unmatched )";
+	if (re->error)
+	{
+		*error = re->error;
+		ReFree(re);
+		return NULL;
+	}
+	RePatch(re, f.outs, ReState(re, RE_MATCH, -1, -1));
+	re->start = f.start;
+	return re;
+}
+
+struct ReCache *ReCacheNew(struct Regex *re)
+{
+	struct ReCache *rc = calloc(1, sizeof(*rc));
+
+	rc->re = re;
+	rc->idle = -1;
+	rc->poolcap = 256;
+	rc->pool = malloc(sizeof(int) * rc->poolcap);
+	rc->list = malloc(sizeof(int) * re->nst);
+	rc->list2 = malloc(sizeof(int) * re->nst);
+	rc->starts = malloc(sizeof(int) * re->nst);
+	rc->starts2 = malloc(sizeof(int) * re->nst);
+	rc->stack = malloc(sizeof(int) * (re->nst * 2 + 1));
+	rc->mark = calloc(re->nst, sizeof(unsigned int));
+	return rc;
+}
+
+void ReCacheFree(struct ReCache *rc)
+{
+	if (rc == NULL) return;
+	free(rc->ds);
+	free(rc->pool);
+	free(rc->hash);
+	free(rc->list);
+	free(rc->list2);
+	free(rc->starts);
+	free(rc->starts2);
+	free(rc->stack);
+	free(rc->mark);
+	free(rc);
+}
+
+// Adds state s and the states it leads to without consuming a byte to list,
+// skipping those already marked with rc->gen. BOL is passed at a line start
+// and EOL at a line end; an EOL not passed yet stays in the list so it can
+// be passed once a line break follows.
+int ReAddClosure(struct ReCache *rc, int *list, int n, int s, bool bol, bool eol)
+{
+	struct Regex *re = rc->re;
+	int sp = 0;
+
+	rc->stack[sp++] = s;
+	while (sp > 0)
+	{
+		s = rc->stack[--sp];
+		if (s < 0 || rc->mark[s] == rc->gen) continue;
+		rc->mark[s] = rc->gen;
+		restate_t *st = &re->st[s];
+		switch (st->op)
+		{
+			case RE_SPLIT:
+				// out1 is pushed first so out is followed first.
+				rc->stack[sp++] = st->out1;
+				rc->stack[sp++] = st->out;
+				break;
+			case RE_JMP:
+				rc->stack[sp++] = st->out;
+				break;
+			case RE_BOL:
+				if (bol)
+					rc->stack[sp++] = st->out;
+				break;
+			case RE_EOL:
+				if (eol)
+					rc->stack[sp++] = st->out;
+				else
+					list[n++] = s;
+				break;
+			default:
+				list[n++] = s;
+				break;
+		}
+	}
+	return n;
+}
+
+int ReCompareInt(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+unsigned int ReHashStates(int *list, int n, bool bol)
+{
+	unsigned int h = bol ? 2166136261u : 16777619u;
+	for (int i = 0; i < n; i++)
+		h = (h ^ (unsigned int)list[i]) * 16777619u;
+	return h;
+}
+
+void ReCacheReset(struct ReCache *rc)
+{
+	rc->nds = 0;
+	rc->idle = -1;
+	rc->poollen = 0;
+	if (rc->hash)
+		memset(rc->hash, -1, sizeof(int) * rc->hashcap);
+}
+
+// Returns the DFA state for a sorted list of NFA states, creating it if
+// needed.
+int ReDState(struct ReCache *rc, int *list, int n, bool bol)
+{
+	unsigned int h = ReHashStates(list, n, bol);
+	int i;
+
+	if (rc->hash == NULL)
+	{
+		rc->hashcap = KILO_RE_DFA_STATES * 2;
+		rc->hash = malloc(sizeof(int) * rc->hashcap);
+		memset(rc->hash, -1, sizeof(int) * rc->hashcap);
+	}
+	for (i = h & (rc->hashcap - 1); rc->hash[i] != -1; i = (i + 1) & (rc->hashcap - 1))
+	{
+		dstate_t *d = &rc->ds[rc->hash[i]];
+		if (d->bol == bol && d->n == n && !memcmp(&rc->pool[d->off], list, sizeof(int) * n))
+			return rc->hash[i];
+	}
+
+	if (rc->nds == rc->dscap)
+	{
+		rc->dscap = rc->dscap ? rc->dscap * 2 : 16;
+		rc->ds = realloc(rc->ds, sizeof(dstate_t) * rc->dscap);
+	}
+	if (rc->poollen + n > rc->poolcap)
+	{
+		rc->poolcap = (rc->poollen + n) * 2;
+		rc->pool = realloc(rc->pool, sizeof(int) * rc->poolcap);
+	}
+	dstate_t *d = &rc->ds[rc->nds];
+	d->off = rc->poollen;
+	d->n = n;
+	d->bol = bol;
+	d->match = false;
+	d->eolmatch = -1;
+	memset(d->next, -1, sizeof(d->next));
+	memcpy(&rc->pool[d->off], list, sizeof(int) * n);
+	rc->poollen += n;
+	for (int j = 0; j < n; j++)
+		if (rc->re->st[list[j]].op == RE_MATCH)
+			d->match = true;
+	rc->hash[i] = rc->nds;
+	return rc->nds++;
+}
+
+// Whether a match ends at DFA state d when a line break follows.
+bool ReEolMatch(struct ReCache *rc, int d)
+{
+	if (rc->ds[d].eolmatch < 0)
+	{
+		int off = rc->ds[d].off, n = rc->ds[d].n, m = 0;
+		bool bol = rc->ds[d].bol;
+		rc->gen++;
+		for (int i = 0; i < n; i++)
+		{
+			int s = rc->pool[off + i];
+			if (rc->re->st[s].op == RE_EOL)
+				m = ReAddClosure(rc, rc->list, m, rc->re->st[s].out, bol, true);
+		}
+		rc->ds[d].eolmatch = 0;
+		for (int i = 0; i < m; i++)
+			if (rc->re->st[rc->list[i]].op == RE_MATCH)
+				rc->ds[d].eolmatch = 1;
+	}
+	return rc->ds[d].eolmatch;
+}
+
+// Follows DFA state d over byte c, returning the next state encoded as in
+// next. A new match may start before every byte.
+int ReDStep(struct ReCache *rc, int d, int c)
+{
+	struct Regex *re = rc->re;
+	bool bol = rc->ds[d].bol;
+	int n = 0, m = 0, i;
+
+	if (rc->nds >= KILO_RE_DFA_STATES)
+	{
+		// Full: start over, keeping only the state being left.
+		n = rc->ds[d].n;
+		memcpy(rc->list2, &rc->pool[rc->ds[d].off], sizeof(int) * n);
+		ReCacheReset(rc);
+		d = ReDState(rc, rc->list2, n, bol);
+	}
+
+	rc->gen++;
+	n = rc->ds[d].n;
+	memcpy(rc->list, &rc->pool[rc->ds[d].off], sizeof(int) * n);
+	for (i = 0; i < n; i++)
+		rc->mark[rc->list[i]] = rc->gen;
+	n = ReAddClosure(rc, rc->list, n, re->start, bol, false);
+
+	rc->gen++;
+	for (i = 0; i < n; i++)
+	{
+		restate_t *st = &re->st[rc->list[i]];
+		if (st->op == RE_SET && ReSetHas(re, st->set, c))
+			m = ReAddClosure(rc, rc->list2, m, st->out, RE_TERM(c), false);
+	}
+	qsort(rc->list2, m, sizeof(int), ReCompareInt);
+	int next = ReDState(rc, rc->list2, m, RE_TERM(c));
+	next = next * 2 + (rc->ds[next].match || RE_TERM(c));
+	rc->ds[d].next[c] = next;
+	return next;
+}
+
+// Builds the idle state and every transition out of it, so that ReScan can
+// skip the bytes that can't start a match without stepping the DFA.
+void ReBuildIdle(struct ReCache *rc)
+{
+	// The idle state and its 256 transitions must fit without ReDStep
+	// starting over, which would free the idle state.
+	if (rc->nds >= KILO_RE_DFA_STATES - 256)
+		ReCacheReset(rc);
+	int idle = ReDState(rc, rc->list, 0, false);
+	for (int c = 0; c < 256; c++)
+	{
+		int x = rc->ds[idle].next[c];
+		if (x < 0)
+			x = ReDStep(rc, idle, c);
+		rc->skip[c] = (x == idle * 2);
+	}
+	rc->idle = idle;
+}
+
+// Returns the last byte of the match ending first in text[0, n), or NULL.
+// bol tells whether text starts a line.
+const char *ReScan(struct ReCache *rc, const char *text, size_t n, bool bol)
+{
+	if (rc->idle < 0)
+		ReBuildIdle(rc);
+	int d = ReDState(rc, rc->list, 0, bol);
+	dstate_t *ds = rc->ds;
+
+	for (size_t i = 0; i < n; i++)
+	{
+		if (d == rc->idle)
+		{
+			while (i < n && rc->skip[(unsigned char)text[i]])
+				i++;
+			if (i == n)
+				break;
+		}
+		unsigned char c = text[i];
+		int x = ds[d].next[c];
+		// Known, not a line end and no match: the common case.
+		if (((unsigned int)x & 0x80000001u) == 0)
+		{
+			d = x >> 1;
+			continue;
+		}
+		if (RE_TERM(c) && ReEolMatch(rc, d))
+			return text + i - 1;
+		if (x < 0)
+			x = ReDStep(rc, d, c);
+		ds = rc->ds;
+		d = x >> 1;
+		if (ds[d].match)
+			return text + i;
+	}
+	if (ReEolMatch(rc, d))
+		return text + n - 1;
+	return NULL;
+}
+
+// Finds the leftmost longest match in line[0, size) starting at or after
+// from. Returns false when there is none.
+bool ReMatch(struct ReCache *rc, const char *line, size_t size, size_t from, size_t *start, size_t *len)
+{
+	struct Regex *re = rc->re;
+	int *clist = rc->list, *nlist = rc->list2;
+	int *cstart = rc->starts, *nstart = rc->starts2;
+	int cn = 0, nn, i;
+	long best = -1, bestend = -1;
+
+	rc->gen++;
+	for (size_t at = from; ; at++)
+	{
+		bool bol = (at == 0) || RE_TERM((unsigned char)line[at - 1]);
+		bool eol = (at == size) || RE_TERM((unsigned char)line[at]);
+
+		// Threads are kept in the order they started, so the first to
+		// reach a state is the leftmost one.
+		if (best < 0)
+		{
+			int k = ReAddClosure(rc, clist, cn, re->start, bol, eol);
+			for (i = cn; i < k; i++)
+				cstart[i] = (int)at;
+			cn = k;
+		}
+		if (cn == 0) break;
+
+		rc->gen++;
+		nn = 0;
+		for (i = 0; i < cn; i++)
+		{
+			restate_t *st = &re->st[clist[i]];
+			if (best >= 0 && cstart[i] > best) continue;
+			if (st->op == RE_MATCH)
+			{
+				if (cstart[i] < (long)at && (best < 0 || cstart[i] < best || (cstart[i] == best && (long)at > bestend)))
+				{
+					best = cstart[i];
+					bestend = at;
+				}
+			}
+			else if (st->op == RE_SET && at < size && ReSetHas(re, st->set, (unsigned char)line[at]))
+			{
+				bool nbol = RE_TERM((unsigned char)line[at]);
+				bool neol = (at + 1 == size) || RE_TERM((unsigned char)line[at + 1]);
+				int k = ReAddClosure(rc, nlist, nn, st->out, nbol, neol);
+				for (int j = nn; j < k; j++)
+					nstart[j] = cstart[i];
+				nn = k;
+			}
+		}
+		if (at == size) break;
+		int *t = clist; clist = nlist; nlist = t;
+		t = cstart; cstart = nstart; nstart = t;
+		cn = nn;
+	}
+	if (best < 0)
+		return false;
+	*start = best;
+	*len = bestend - best;
+	return true;
+}
+
+/*** Search ***/
+
+// A compiled query, literal or regex. Literal needles up to
+// KILO_SEARCH_SIMD_MAX bytes are found with SSE2 by testing 16 positions at
+// a time for their first and last byte, longer ones and everything off x86
+// with Boyer-Moore-Horspool. Case is folded while comparing, so the text is
+// never copied.
+struct Search {
+	char *needle;
+	size_t len;
+	bool icase;
+	bool regex;
+	struct Regex *re;	// NULL unless regex compiled.
+	struct ReCache *cache;	// DFA of re for the thread using this Search.
+	unsigned char fold[256];	// Bytes as compared, lowercased when icase.
+	size_t skip[256];		// Horspool shift by the byte under the needle's end.
+};
+
+// Returns NULL, or why a regex query doesn't compile.
+const char *SearchCompile(struct Search *s, const char *query, bool icase, bool regex)
+{
+	const char *error = NULL;
+	size_t i;
+
+	free(s->needle);
+	s->needle = strdup(query);
+	s->len = strlen(query);
+	s->icase = icase;
+	s->regex = regex;
+	ReCacheFree(s->cache);
+	ReFree(s->re);
+	s->cache = NULL;
+	s->re = NULL;
+	if (regex && s->len > 0 && (s->re = ReCompile(query, icase, &error)) != NULL)
+		s->cache = ReCacheNew(s->re);
+	for (i = 0; i < 256; i++)
+		s->fold[i] = icase ? tolower(i) : i;
+
+	size_t shift[256];
+	for (i = 0; i < 256; i++)
+		shift[i] = s->len;
+	for (i = 0; i + 1 < s->len; i++)
+		shift[s->fold[(unsigned char)query[i]]] = s->len - 1 - i;
+	for (i = 0; i < 256; i++)
+		s->skip[i] = shift[s->fold[i]];
+	return error;
+}
+
+// Whether the query can match anything.
+bool SearchValid(struct Search *s)
+{
+	return s->len > 0 && (!s->regex || s->re);
+}
+
+bool SearchMatchAt(struct Search *s, const char *p)
+{
+	if (!s->icase)
+		return memcmp(p, s->needle, s->len) == 0;
+	for (size_t i = 0; i < s->len; i++)
+		if (s->fold[(unsigned char)p[i]] != s->fold[(unsigned char)s->needle[i]])
+			return false;
+	return true;
+}
+
+const char *SearchHorspool(struct Search *s, const char *text, size_t n)
+{
+	size_t last = s->len - 1;
+
+	for (size_t i = 0; i + s->len <= n; i += s->skip[(unsigned char)text[i + last]])
+		if (SearchMatchAt(s, text + i))
+			return text + i;
+	return NULL;
+}
+
+#if KILO_X86
+const char *SearchSSE2(struct Search *s, const char *text, size_t n)
+{
+	unsigned char first = s->fold[(unsigned char)s->needle[0]];
+	unsigned char last = s->fold[(unsigned char)s->needle[s->len - 1]];
+	const __m128i f0 = _mm_set1_epi8(first), f1 = _mm_set1_epi8(s->icase ? toupper(first) : first);
+	const __m128i l0 = _mm_set1_epi8(last), l1 = _mm_set1_epi8(s->icase ? toupper(last) : last);
+	size_t i = 0;
+
+	for (; i + 15 + s->len <= n; i += 16)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)(text + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(text + i + s->len - 1));
+		__m128i fa = _mm_or_si128(_mm_cmpeq_epi8(a, f0), _mm_cmpeq_epi8(a, f1));
+		__m128i lb = _mm_or_si128(_mm_cmpeq_epi8(b, l0), _mm_cmpeq_epi8(b, l1));
+		unsigned int mask = _mm_movemask_epi8(_mm_and_si128(fa, lb));
+		while (mask)
+		{
+			const char *p = text + i + CountTrailingZeros(mask);
+			if (SearchMatchAt(s, p))
+				return p;
+			mask &= mask - 1;
+		}
+	}
+	return SearchHorspool(s, text + i, n - i);
+}
+#endif
+
+// Returns the first match in text[0, n), or NULL.
+const char *SearchFirst(struct Search *s, const char *text, size_t n)
+{
+	if (s->len == 0 || n < s->len)
+		return NULL;
+#if KILO_X86
+	if (s->len <= KILO_SEARCH_SIMD_MAX)
+		return SearchSSE2(s, text, n);
+#endif
+	return SearchHorspool(s, text, n);
+}
+
+// Finds the first match in line[0, size) starting at or after from.
+bool SearchLine(struct Search *s, const char *line, size_t size, size_t from, size_t *start, size_t *len)
+{
+	if (s->regex)
+		return s->re && ReMatch(s->cache, line, size, from, start, len);
+	if (from > size)
+		return false;
+	const char *m = SearchFirst(s, line + from, size - from);
+	if (m == NULL)
+		return false;
+	*start = m - line;
+	*len = s->len;
+	return true;
+}
+
+/*** Find ***/
+
+// Whether the bytes of next follow those of line in the file mapping with
+// only a line break between them.
+bool EditorLinesAdjacent(line_t *line, line_t *next)
+{
+	if (!line->mapped || !next->mapped) return false;
+	const char *end = line->bytes + line->size;
+	if (next->bytes == end + 1)
+		return end[0] == '\n';
+	return next->bytes == end + 2 && end[0] == '\r' && end[1] == '\n';
+}
+
+// Finds the first match at or after byte col of line at, looking no further
+// than line end. Lines still lying back to back in the file mapping are
+// searched as one block, no match spans a line break. Blocks start small
+// for nearby matches and double up to KILO_SEARCH_BLOCK bytes.
+bool EditorSearchForward(struct Search *s, int at, int col, int end, pos_t *match, int *len)
+{
+	ptrdiff_t block = 4096;
+
+	while (at < end)
+	{
+		line_t *line = EditorLine(at);
+		if (col > line->size)
+			col = line->size;
+		const char *from = line->bytes + col;
+		const char *stop = line->bytes + line->size;
+		int last = at;
+
+		while (last + 1 < end && stop - from < block)
+		{
+			line_t *next = EditorLine(last + 1);
+			if (!EditorLinesAdjacent(line, next)) break;
+			stop = next->bytes + next->size;
+			line = next;
+			last++;
+		}
+
+		// A regex scan stops at the end of the first match.
+		const char *m = s->regex ? ReScan(s->cache, from, stop - from, col == 0) : SearchFirst(s, from, stop - from);
+		if (m)
+		{
+			// Lines of a block ascend in memory: take the last one starting
+			// at or before the match.
+			int lo = at, hi = last;
+			while (lo < hi)
+			{
+				int mid = lo + (hi - lo + 1) / 2;
+				if (EditorLine(mid)->bytes <= m)
+					lo = mid;
+				else
+					hi = mid - 1;
+			}
+			line = EditorLine(lo);
+			size_t start, mlen;
+			if (SearchLine(s, line->bytes, line->size, (lo == at) ? col : 0, &start, &mlen))
+			{
+				match->Y = lo;
+				match->X = start;
+				*len = mlen;
+				return true;
+			}
+			last = lo;
+		}
+		at = last + 1;
+		col = 0;
+		if (block < KILO_SEARCH_BLOCK)
+			block *= 2;
+	}
+	return false;
+}
+
+// Finds the last match starting before byte col of line at, looking no
+// further up than line end.
+bool EditorSearchBackward(struct Search *s, int at, int col, int end, pos_t *match, int *len)
+{
+	for (; at >= end; at--)
+	{
+		line_t *line = EditorLine(at);
+		size_t from = 0, start, mlen;
+		bool found = false;
+
+		if (col < 0)
+			col = line->size + 1;
+		while (SearchLine(s, line->bytes, line->size, from, &start, &mlen) && start < (size_t)col)
+		{
+			match->Y = at;
+			match->X = start;
+			*len = mlen;
+			found = true;
+			from = start + 1;
+		}
+		if (found)
+			return true;
+		col = -1;
+	}
+	return false;
+}
+
+typedef struct match {
+	int line;
+	int col;	// Byte offset in the line.
+	int len;
+} match_t;
+
+// A result set of an earlier query, kept while the find prompt is open so
+// that deleting the end of the query doesn't search the file again.
+typedef struct findcache {
+	char *query;
+	bool icase;
+	bool regex;
+	match_t *m;
+	size_t count;
+	size_t cap;
+	bool truncated;
+} findcache_t;
+
+// Every match of the find query in file order, for counting and for moving
+// between matches. Built by EditorFindAll and valid while hl_gen, which
+// changes with every edit, stays the same.
+struct MatchIndex {
+	struct Search search;
+	match_t *m;
+	size_t count;
+	size_t cap;
+	size_t current;		// Match the cursor is on.
+	pos_t at;		// Position of that match.
+	bool found;		// The cursor is on a match.
+	bool truncated;		// Stopped at KILO_FIND_MAX_MATCHES; moving falls back to searching.
+	bool active;		// The find prompt is open: matches are shown.
+	bool regex;		// The query is a regex; Ctrl-R in the prompt toggles it.
+	const char *error;	// Why the regex doesn't compile.
+	char prompt[64];
+	unsigned int gen;
+	findcache_t cache[KILO_FIND_CACHE];	// Oldest first, all from gen.
+	int ncache;
+} Matches;
+
+typedef struct findjob {
+	int from;
+	int to;
+	match_t *m;
+	size_t count;
+	size_t cap;
+	bool truncated;
+	thread_t thread;
+	bool started;		// Runs on thread, else on the caller after the others.
+} findjob_t;
+
+// Each job gets a DFA of its own as they fill up while searching.
+void FindJobRun(void *arg)
+{
+	findjob_t *job = arg;
+	struct Search search = Matches.search;
+	struct Search *s = &search;
+	int at = job->from, col = 0, len;
+	pos_t p;
+
+	if (s->re)
+		s->cache = ReCacheNew(s->re);
+	while (EditorSearchForward(s, at, col, job->to, &p, &len))
+	{
+		if (job->count == KILO_FIND_MAX_MATCHES)
+		{
+			job->truncated = true;
+			break;
+		}
+		if (job->count == job->cap)
+		{
+			job->cap = job->cap ? job->cap * 2 : 256;
+			job->m = realloc(job->m, sizeof(match_t) * job->cap);
+		}
+		job->m[job->count].line = p.Y;
+		job->m[job->count].col = p.X;
+		job->m[job->count].len = len;
+		job->count++;
+		at = p.Y;
+		col = p.X + len;
+	}
+	if (s->re)
+		ReCacheFree(s->cache);
+}
+
+// Finds every match of Matches.search, splitting the lines between threads
+// and joining their lists in order.
+void EditorFindAll(void)
+{
+	findjob_t jobs[KILO_MAX_THREADS];
+	int njobs = (int)(E.linesnum / KILO_FIND_CHUNK_LINES);
+	int j;
+
+	if (njobs > ThreadCount()) njobs = ThreadCount();
+	if (njobs < 1) njobs = 1;
+	for (j = 0; j < njobs; j++)
+	{
+		memset(&jobs[j], 0, sizeof(jobs[j]));
+		jobs[j].from = (int)(E.linesnum / njobs * j);
+		jobs[j].to = (j == njobs - 1) ? (int)E.linesnum : (int)(E.linesnum / njobs * (j + 1));
+	}
+
+	// The lines stay put meanwhile: this thread holds E.lock.
+	for (j = 1; j < njobs; j++)
+		jobs[j].started = ThreadStart(&jobs[j].thread, FindJobRun, &jobs[j]);
+	FindJobRun(&jobs[0]);
+	for (j = 1; j < njobs; j++)
+	{
+		if (jobs[j].started)
+			ThreadJoin(&jobs[j].thread);
+		else
+			FindJobRun(&jobs[j]);
+	}
+
+	Matches.count = 0;
+	Matches.truncated = false;
+	for (j = 0; j < njobs; j++)
+	{
+		size_t n = jobs[j].count;
+		if (Matches.truncated || Matches.count + n > KILO_FIND_MAX_MATCHES)
+		{
+			n = KILO_FIND_MAX_MATCHES - Matches.count;
+			Matches.truncated = true;
+		}
+		if (Matches.count + n > Matches.cap)
+		{
+			Matches.cap = Matches.count + n;
+			Matches.m = realloc(Matches.m, sizeof(match_t) * Matches.cap);
+		}
+		if (n)
+			memcpy(&Matches.m[Matches.count], jobs[j].m, sizeof(match_t) * n);
+		Matches.count += n;
+		Matches.truncated |= jobs[j].truncated;
+		free(jobs[j].m);
+	}
+	Matches.gen = E.hl_gen;
+}
+
+// Moves the index out into c, leaving it empty.
+void EditorFindTake(findcache_t *c)
+{
+	struct Search *s = &Matches.search;
+
+	memset(c, 0, sizeof(*c));
+	if (!SearchValid(s) || Matches.gen != E.hl_gen)
+	{
+		Matches.count = 0;
+		Matches.truncated = false;
+		return;
+	}
+	c->query = strdup(s->needle);
+	c->icase = s->icase;
+	c->regex = s->regex;
+	c->m = Matches.m;
+	c->count = Matches.count;
+	c->cap = Matches.cap;
+	c->truncated = Matches.truncated;
+	Matches.m = NULL;
+	Matches.count = Matches.cap = 0;
+	Matches.truncated = false;
+}
+
+void EditorFindCacheDrop(int i)
+{
+	free(Matches.cache[i].query);
+	free(Matches.cache[i].m);
+	Matches.ncache--;
+	memmove(&Matches.cache[i], &Matches.cache[i + 1], sizeof(findcache_t) * (Matches.ncache - i));
+}
+
+void EditorFindCacheClear(void)
+{
+	while (Matches.ncache > 0)
+		EditorFindCacheDrop(Matches.ncache - 1);
+}
+
+// Adds c to the cache, dropping the oldest sets to keep at most
+// KILO_FIND_MAX_MATCHES matches there.
+void EditorFindKeep(findcache_t *c)
+{
+	size_t total = c->count;
+	int i;
+
+	if (c->query == NULL)
+		return;
+	for (i = 0; i < Matches.ncache; i++)
+		total += Matches.cache[i].count;
+	while (Matches.ncache > 0 && (Matches.ncache == KILO_FIND_CACHE || total > KILO_FIND_MAX_MATCHES))
+	{
+		total -= Matches.cache[0].count;
+		EditorFindCacheDrop(0);
+	}
+	if (total > KILO_FIND_MAX_MATCHES)
+	{
+		free(c->query);
+		free(c->m);
+		return;
+	}
+	Matches.cache[Matches.ncache++] = *c;
+}
+
+// Moves the cached set for query into the index, if there is one.
+bool EditorFindCached(const char *query, bool icase, bool regex)
+{
+	for (int i = Matches.ncache - 1; i >= 0; i--)
+	{
+		findcache_t *c = &Matches.cache[i];
+		if (c->icase != icase || c->regex != regex || strcmp(c->query, query))
+			continue;
+		free(Matches.m);
+		Matches.m = c->m;
+		Matches.count = c->count;
+		Matches.cap = c->cap;
+		Matches.truncated = c->truncated;
+		c->m = NULL;
+		EditorFindCacheDrop(i);
+		return true;
+	}
+	return false;
+}
+
+// Whether the matches of Matches.search are all found among those of old:
+// a plain query that extends old, and matches case at least as strictly.
+bool EditorFindCanNarrow(findcache_t *old)
+{
+	struct Search *s = &Matches.search;
+	size_t len = old->query ? strlen(old->query) : 0;
+
+	return len > 0 && !old->regex && !s->regex && !old->truncated && s->len > len &&
+		(old->icase || !s->icase) && strncmp(s->needle, old->query, len) == 0;
+}
+
+// Builds the index from the matches of a shorter query. Every occurrence
+// of that query starts inside one of the matches found for it, which skip
+// the overlapping ones, so only those bytes need to be tried.
+void EditorFindNarrow(findcache_t *old)
+{
+	struct Search *s = &Matches.search;
+	size_t oldlen = strlen(old->query), i;
+	int y = -1, end = 0;
+	line_t *line = NULL;
+
+	Matches.count = 0;
+	for (i = 0; i < old->count; i++)
+	{
+		match_t *o = &old->m[i];
+		if (o->line != y)
+		{
+			y = o->line;
+			line = EditorLine(y);
+			end = 0;
+		}
+		int col = o->col > end ? o->col : end;
+		for (; col < o->col + (int)oldlen && col + s->len <= line->size; col++)
+		{
+			if (!SearchMatchAt(s, &line->bytes[col]))
+				continue;
+			if (Matches.count == Matches.cap)
+			{
+				Matches.cap = Matches.cap ? Matches.cap * 2 : 256;
+				Matches.m = realloc(Matches.m, sizeof(match_t) * Matches.cap);
+			}
+			Matches.m[Matches.count].line = y;
+			Matches.m[Matches.count].col = col;
+			Matches.m[Matches.count].len = (int)s->len;
+			Matches.count++;
+			end = col + (int)s->len;
+			break;
+		}
+	}
+	Matches.truncated = false;
+	Matches.gen = E.hl_gen;
+}
+
+// Index of the first match at or after line at, byte col.
+size_t EditorFindMatchAfter(int at, int col)
+{
+	size_t lo = 0, hi = Matches.count;
+
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		match_t *m = &Matches.m[mid];
+		if (m->line < at || (m->line == at && m->col < col))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Moves between matches in the index, or by searching the text when the
+// index is incomplete. Returns false when there is no match.
+bool EditorFindMove(int key, bool changed)
+{
+	pos_t p;
+	int len;
+
+	if (!Matches.truncated)
+	{
+		if (Matches.count == 0)
+			return false;
+		if (changed || !Matches.found)
+		{
+			Matches.current = EditorFindMatchAfter(E.cursor.Y, E.cursor.X);
+			if (Matches.current == Matches.count)
+				Matches.current = 0;
+		}
+		else if (key == ARROW_LEFT || key == ARROW_UP)
+			Matches.current = (Matches.current ? Matches.current : Matches.count) - 1;
+		else if (key == ARROW_RIGHT || key == ARROW_DOWN)
+			Matches.current = (Matches.current + 1) % Matches.count;
+		Matches.at.Y = Matches.m[Matches.current].line;
+		Matches.at.X = Matches.m[Matches.current].col;
+		return true;
+	}
+
+	struct Search *s = &Matches.search;
+	if (Matches.found && !changed && (key == ARROW_LEFT || key == ARROW_UP))
+	{
+		if (!EditorSearchBackward(s, Matches.at.Y, Matches.at.X, 0, &p, &len) &&
+			!EditorSearchBackward(s, E.linesnum - 1, -1, Matches.at.Y, &p, &len))
+			return false;
+	}
+	else
+	{
+		int at = E.cursor.Y, col = E.cursor.X;
+		if (Matches.found && !changed && (key == ARROW_RIGHT || key == ARROW_DOWN))
+		{
+			at = Matches.at.Y;
+			col = Matches.at.X + 1;
+		}
+		if (at >= E.linesnum)
+			at = col = 0;
+		if (!EditorSearchForward(s, at, col, E.linesnum, &p, &len) &&
+			!EditorSearchForward(s, 0, 0, at + 1, &p, &len))
+			return false;
+	}
+	Matches.at = p;
+	return true;
+}
+
+// A query ignores case unless it has capitals; escapes like \W don't count.
+bool EditorQueryIgnoresCase(const char *query, bool regex)
+{
+	for (const char *q = query; *q; q++)
+	{
+		if (regex && q[0] == '\\' && q[1])
+			q++;
+		else if (isupper((unsigned char)*q))
+			return false;
+	}
+	return true;
+}
+
+void EditorFindPrompt(void)
+{
+	snprintf(Matches.prompt, sizeof(Matches.prompt), "%s: %%s (Arrows, Ctrl-R regex, ESC or Enter)",
+		Matches.regex ? "Regex search" : "Search");
+}
+
+// Searches as the query is typed: every match is found up front, the cursor
+// goes to the first one at or after it, and the arrow keys move through the
+// rest. A longer query only tries the matches of the one before, and going
+// back to an earlier query reuses its matches.
+void EditorFindCallback(char *query, int key)
+{
+	if (key == '\r' || key == '\x1b')
+		return;
+	if (key == CTRL_KEY('r'))
+	{
+		Matches.regex = !Matches.regex;
+		EditorFindPrompt();
+	}
+
+	double t = ClockNow();
+	bool icase = EditorQueryIgnoresCase(query, Matches.regex);
+	struct Search *s = &Matches.search;
+	bool changed = s->needle == NULL || strcmp(s->needle, query) || s->icase != icase ||
+		s->regex != Matches.regex || Matches.gen != E.hl_gen;
+	if (changed)
+	{
+		findcache_t old;
+
+		if (Matches.gen != E.hl_gen)
+			EditorFindCacheClear();
+		EditorFindTake(&old);
+		Matches.error = SearchCompile(s, query, icase, Matches.regex);
+		Matches.found = false;
+		if (SearchValid(s) && E.linesnum > 0 && !EditorFindCached(query, icase, Matches.regex))
+		{
+			if (EditorFindCanNarrow(&old))
+				EditorFindNarrow(&old);
+			else
+				EditorFindAll();
+		}
+		EditorFindKeep(&old);
+	}
+
+	if (SearchValid(s) && E.linesnum > 0)
+		Matches.found = EditorFindMove(key, changed);
+	if (Matches.found)
+	{
+		E.cursor = Matches.at;
+		E.offset.Y = E.linesnum;
+	}
+	PerfEnd(PERF_FIND, t);
+}
+
+// Writes the match counter shown in the status bar while finding.
+int EditorFindStatus(char *buf, size_t size)
+{
+	buf[0] = '\0';
+	if (!Matches.active || Matches.search.len == 0)
+		return 0;
+	if (Matches.error)
+		return snprintf(buf, size, "%s | ", Matches.error);
+	if (Matches.truncated)
+		return snprintf(buf, size, "over %zu matches | ", Matches.count);
+	if (!Matches.found)
+		return snprintf(buf, size, "no matches | ");
+	return snprintf(buf, size, "match %zu of %zu | ", Matches.current + 1, Matches.count);
+}
+
+// Marks the matches on the visible lines in the frame being drawn.
+void EditorDrawMatches(void)
+{
+	struct Search *s = &Matches.search;
+	unsigned char color = EditorSyntaxToColor(HL_MATCH);
+	int i;
+
+	if (!Matches.active || !SearchValid(s)) return;
+
+	for (i = 0; i < E.bufSize.Y && E.offset.Y + i < E.linesnum; i++)
+	{
+		line_t *line = EditorLine(E.offset.Y + i);
+		unsigned char *attr = &E.frame.attr[i * E.screen.X];
+		size_t col = 0, start, len;
+
+		while (SearchLine(s, line->bytes, line->size, col, &start, &len))
+		{
+			int from = EditorLineCxToRx(line, start) - E.offset.X;
+			int to = EditorLineCxToRx(line, start + len) - E.offset.X;
+			if (from < 0) from = 0;
+			if (to > E.bufSize.X) to = E.bufSize.X;
+			if (from < to)
+				memset(&attr[from], color, to - from);
+			col = start + len;
+		}
+	}
+}
+
+void EditorFind(void)
+{
+	pos_t saved_cursor = E.cursor;
+	pos_t saved_offset = E.offset;
+
+	Matches.active = true;
+	Matches.found = false;
+	Matches.error = NULL;
+	SearchCompile(&Matches.search, "", false, false);
+	EditorFindPrompt();
+	char *query = EditorPrompt(Matches.prompt, EditorFindCallback, false);
+	Matches.active = false;
+	EditorFindCacheClear();
+	
+	if (query)
+	{
+		free(query);
+	}
+	else
+	{
+		E.cursor = saved_cursor;
+		E.offset = saved_offset;
+	}
+}
+
+/*** Append Buffer ***/
+struct abuf {
+	char *b;
+	int len;
+	int cap;
+};
+
+#define ABUF_INIT {NULL, 0, 0}
+
+// Makes room for len more bytes. The buffer grows geometrically and is
+// meant to be reused, so it stops allocating once it held the largest
+// output.
+bool abReserve(struct abuf *ab, int len)
+{
+	if (ab->len + len <= ab->cap) return true;
+
+	int cap = ab->cap ? ab->cap : 4096;
+	while (cap < ab->len + len)
+		cap *= 2;
+	char *new = PerfRealloc(ab->b, cap);
+	if (new == NULL) return false;
+	ab->b = new;
+	ab->cap = cap;
+	return true;
+}
+
+void abAppend(struct abuf *ab, const char *s, int len)
+{
+	if (!abReserve(ab, len)) return;
+	memcpy(&ab->b[ab->len], s, len);
+	ab->len += len;
+}
+
+// Appends CSI a;b final, or CSI a final when b is negative.
+void abAppendCsi(struct abuf *ab, int a, int b, char final)
+{
+	char buf[32];
+	int len = 0;
+	int n = 0;
+	char digits[12];
+
+	if (!abReserve(ab, sizeof(buf))) return;
+	buf[len++] = '\x1b';
+	buf[len++] = '[';
+	for (int j = 0; j < 2; j++)
+	{
+		int v = j ? b : a;
+		if (j && v < 0) break;
+		if (j) buf[len++] = ';';
+		do
+		{
+			digits[n++] = '0' + v % 10;
+			v /= 10;
+		} while (v);
+		while (n)
+			buf[len++] = digits[--n];
+	}
+	buf[len++] = final;
+	memcpy(&ab->b[ab->len], buf, len);
+	ab->len += len;
+}
+
+void abFree(struct abuf *ab)
+{
+	free(ab->b);
+	ab->b = NULL;
+	ab->len = ab->cap = 0;
+}
+
+/*** Replace ***/
+
+// Replaces every match of the search with text as one edit: the lines with
+// matches are rebuilt once each, and highlighting is invalidated once from
+// the first of them. Returns the number of matches replaced.
+size_t EditorReplaceAll(struct Search *s, const char *text, int *lines)
+{
+	struct abuf out = ABUF_INIT;
+	size_t textlen = strlen(text), count = 0;
+	int at = 0, first = -1, len;
+	pos_t p;
+
+	*lines = 0;
+	while (at < E.linesnum && EditorSearchForward(s, at, 0, E.linesnum, &p, &len))
+	{
+		line_t *line = EditorLine(p.Y);
+		size_t col = 0, start, mlen;
+
+		out.len = 0;
+		if (!abReserve(&out, line->size + textlen))
+			break;
+		// Each match is logged as its own edit, leaving the rest of the
+		// line out of the undo log.
+		while (SearchLine(s, line->bytes, line->size, col, &start, &mlen))
+		{
+			abAppend(&out, &line->bytes[col], start - col);
+			UndoRecord(UNDO_DELETE_TEXT, p.Y, out.len, &line->bytes[start], mlen);
+			UndoRecord(UNDO_INSERT_TEXT, p.Y, out.len, text, textlen);
+			abAppend(&out, text, textlen);
+			col = start + mlen;
+			count++;
+		}
+		abAppend(&out, &line->bytes[col], line->size - col);
+		EditorLineSetBytes(line, out.b, out.len);
+		if (first < 0)
+			first = p.Y;
+		(*lines)++;
+		at = p.Y + 1;
+	}
+	abFree(&out);
+
+	if (first >= 0)
+	{
+		EditorInvalidateSyntax(first);
+		E.dirty++;
+		if (E.cursor.Y < E.linesnum && E.cursor.X > EditorLine(E.cursor.Y)->size)
+			E.cursor.X = EditorLine(E.cursor.Y)->size;
+	}
+	return count;
+}
+
+void EditorReplace(void)
+{
+	struct Search s;
+	int lines;
+
+	char *pattern = EditorPrompt("Replace regex: %s (ESC to cancel)", NULL, false);
+	if (pattern == NULL)
+		return;
+	memset(&s, 0, sizeof(s));
+	const char *error = SearchCompile(&s, pattern, EditorQueryIgnoresCase(pattern, true), true);
+	free(pattern);
+	if (error)
+	{
+		EditorSetStatusMessage("Bad regex: %s", error);
+		return;
+	}
+
+	char *text = EditorPrompt("Replace with: %s (ESC to cancel)", NULL, true);
+	if (text)
+	{
+		double t = ClockNow();
+		size_t count = EditorReplaceAll(&s, text, &lines);
+		PerfEnd(PERF_FIND, t);
+		EditorSetStatusMessage("Replaced %zu matches on %d lines", count, lines);
+		free(text);
+	}
+	SearchCompile(&s, "", false, false);
+	free(s.needle);
+}
+
+/*** Screen ***/
+
+// Frames are drawn into E.frame and compared with E.shown, the cells the
+// console already displays, so that only what changed is written out.
+
+struct EscapeSeq {
+	char s[15];
+	unsigned char len;
+};
+
+// SGR sequences for every attribute: SgrSet resets and sets it from any
+// state, SgrColor only changes the colour.
+struct EscapeSeq SgrSet[256];
+struct EscapeSeq SgrColor[256];
+
+void ScreenInitEscapes(void)
+{
+	for (int attr = 0; attr < 256; attr++)
+	{
+		int color = (attr & ~ATTR_INVERSE) ? attr & ~ATTR_INVERSE : 39;
+		if (attr == 0)
+			SgrSet[attr].len = snprintf(SgrSet[attr].s, sizeof(SgrSet[attr].s), "\x1b[m");
+		else
+			SgrSet[attr].len = snprintf(SgrSet[attr].s, sizeof(SgrSet[attr].s), "\x1b[0;%s%dm", (attr & ATTR_INVERSE) ? "7;" : "", color);
+		SgrColor[attr].len = snprintf(SgrColor[attr].s, sizeof(SgrColor[attr].s), "\x1b[%dm", color);
+	}
+}
+
+// Writes len glyphs to row y from column x on, clipped to the screen.
+void ScreenPut(int y, int x, const char *s, int len, unsigned char attr)
+{
+	if (x < 0)
+	{
+		s -= x;
+		len += x;
+		x = 0;
+	}
+	if (len > E.screen.X - x)
+		len = E.screen.X - x;
+	if (len <= 0) return;
+	memcpy(&E.frame.ch[y * E.screen.X + x], s, len);
+	memset(&E.frame.attr[y * E.screen.X + x], attr, len);
+}
+
+void ScreenFill(screen_t *s, size_t from, size_t n)
+{
+	memset(&s->ch[from], ' ', n);
+	memset(&s->attr[from], 0, n);
+}
+
+// Starts a frame of blank cells, reallocating both frames when the console
+// was resized.
+void ScreenBegin(void)
+{
+	int width = E.bufSize.X;
+	int height = E.bufSize.Y + 2;
+	size_t cells = (size_t)width * height;
+
+	if (E.frame.ch == NULL || width != E.screen.X || height != E.screen.Y)
+	{
+		if (E.frame.ch == NULL)
+			ScreenInitEscapes();
+		free(E.frame.ch);
+		free(E.shown.ch);
+		E.frame.ch = PerfMalloc(cells * 2);
+		E.frame.attr = (unsigned char *)&E.frame.ch[cells];
+		E.shown.ch = PerfMalloc(cells * 2);
+		E.shown.attr = (unsigned char *)&E.shown.ch[cells];
+		E.screen.X = width;
+		E.screen.Y = height;
+		E.frame_full = true;
+	}
+	ScreenFill(&E.frame, 0, cells);
+}
+
+void ScreenSetAttr(struct abuf *ab, int *current, unsigned char attr)
+{
+	if (*current == attr) return;
+	struct EscapeSeq *seq = (attr != 0 && !((*current ^ attr) & ATTR_INVERSE)) ? &SgrColor[attr] : &SgrSet[attr];
+	abAppend(ab, seq->s, seq->len);
+	*current = attr;
+}
+
+// Whether a row holds only ASCII, so that its cells are its columns.
+bool ScreenRowAscii(const char *ch, int width)
+{
+	for (int x = 0; x < width; x++)
+		if (ch[x] & 0x80)
+			return false;
+	return true;
+}
+
+void ScreenMoveTo(struct abuf *ab, pos_t *at, int x, int y)
+{
+	if (at->Y == y && at->X == x) return;
+	if (at->Y == y && at->X >= 0 && x > at->X)
+		abAppendCsi(ab, x - at->X, -1, 'C');
+	else
+		abAppendCsi(ab, y + 1, x + 1, 'H');
+	at->X = x;
+	at->Y = y;
+}
+
+// Shifts the text rows of the shown frame by the change of the vertical
+// offset with a scroll region, when the view moved by less than half a
+// screen and the columns stayed put.
+bool ScreenScroll(struct abuf *ab)
+{
+	int rows = E.bufSize.Y;
+	int dy = E.offset.Y - E.shown_offset.Y;
+	size_t width = E.screen.X;
+
+	if (dy == 0 || abs(dy) >= rows / 2 || E.offset.X != E.shown_offset.X) return false;
+
+	abAppend(ab, "\x1b[?25l", 6);
+	abAppendCsi(ab, 1, rows, 'r');
+	abAppendCsi(ab, abs(dy), -1, dy > 0 ? 'S' : 'T');
+	abAppend(ab, "\x1b[r", 3);
+
+	size_t keep = (rows - abs(dy)) * width;
+	size_t vacated = abs(dy) * width;
+	if (dy > 0)
+	{
+		memmove(E.shown.ch, &E.shown.ch[vacated], keep);
+		memmove(E.shown.attr, &E.shown.attr[vacated], keep);
+		ScreenFill(&E.shown, keep, vacated);
+	}
+	else
+	{
+		memmove(&E.shown.ch[vacated], E.shown.ch, keep);
+		memmove(&E.shown.attr[vacated], E.shown.attr, keep);
+		ScreenFill(&E.shown, 0, vacated);
+	}
+	return true;
+}
+
+// Appends the escapes turning the shown frame into the new one. Changed
+// cells are written in spans, with short runs of unchanged cells between
+// them rewritten rather than skipped, and a blank row tail is cleared
+// with an erase instead of spaces. Glyphs of a span sharing an attribute
+// are copied out in one go. Cells are bytes, so on a row with multibyte
+// UTF-8 they don't line up with the columns: such rows are rewritten from
+// their start. Every frame ends with the default attribute. Returns
+// whether anything was written, leaving the cursor hidden.
+bool ScreenFlush(struct abuf *ab)
+{
+	int width = E.screen.X;
+	int attr = 0;
+	pos_t at = { -1, -1 };
+	bool hidden = false;
+
+	if (E.frame_full)
+	{
+		abAppend(ab, "\x1b[?25l\x1b[m\x1b[2J", 13);
+		ScreenFill(&E.shown, 0, (size_t)width * E.screen.Y);
+		hidden = true;
+		E.frame_full = false;
+	}
+	else
+		hidden = ScreenScroll(ab);
+	E.shown_offset = E.offset;
+
+	for (int y = 0; y < E.screen.Y; y++)
+	{
+		char *ch = &E.frame.ch[y * width];
+		unsigned char *at_row = &E.frame.attr[y * width];
+		char *old = &E.shown.ch[y * width];
+		unsigned char *old_attr = &E.shown.attr[y * width];
+
+		if (!memcmp(ch, old, width) && !memcmp(at_row, old_attr, width))
+			continue;
+
+		int blank = width;
+		while (blank > 0 && ch[blank - 1] == ' ' && at_row[blank - 1] == 0)
+			blank--;
+		bool ascii = ScreenRowAscii(ch, width) && ScreenRowAscii(old, width);
+
+		int x = 0;
+		while (x < width)
+		{
+			if (ch[x] == old[x] && at_row[x] == old_attr[x])
+			{
+				x++;
+				continue;
+			}
+
+			int last = x;
+			for (int j = x + 1; j < width && j - last <= KILO_SPAN_GAP; j++)
+				if (ch[j] != old[j] || at_row[j] != old_attr[j])
+					last = j;
+
+			if (!ascii)
+			{
+				x = 0;
+				last = width - 1;
+			}
+
+			if (!hidden)
+			{
+				abAppend(ab, "\x1b[?25l", 6);
+				hidden = true;
+			}
+			ScreenMoveTo(ab, &at, x, y);
+
+			bool erase = (last >= blank && width - blank > 3);
+			int end = erase ? (x > blank ? x : blank) : last + 1;
+			for (int j = x; j < end; )
+			{
+				int run = j + 1;
+				while (run < end && at_row[run] == at_row[j])
+					run++;
+				ScreenSetAttr(ab, &attr, at_row[j]);
+				abAppend(ab, &ch[j], run - j);
+				j = run;
+			}
+			memcpy(&old[x], &ch[x], end - x);
+			memcpy(&old_attr[x], &at_row[x], end - x);
+			at.X = (end < width && ascii) ? end : -1;
+
+			if (erase)
+			{
+				ScreenSetAttr(ab, &attr, 0);
+				abAppend(ab, "\x1b[K", 3);
+				ScreenFill(&E.shown, (size_t)y * width + end, width - end);
+				break;
+			}
+			x = end;
+		}
+	}
+
+	ScreenSetAttr(ab, &attr, 0);
+	return hidden;
+}
+
+/*** Output ***/
+void EditorScroll(void)
+{
+	E.rx = E.cursor.X;
+	if (E.cursor.Y < E.linesnum)
+		E.rx = EditorLineCxToRx(EditorLine(E.cursor.Y), E.cursor.X);
+
+	if (E.cursor.Y < E.offset.Y)
+		E.offset.Y = E.cursor.Y;
+	if (E.cursor.Y >= E.offset.Y + E.bufSize.Y)
+		E.offset.Y = E.cursor.Y - E.bufSize.Y + 1;
+	if (E.rx < E.offset.X)
+		E.offset.X = E.rx;
+	if (E.rx >= E.offset.X + E.bufSize.X)
+		E.offset.X = E.rx - E.bufSize.X + 1;
+}
+
+void EditorDrawLines(void)
+{
+	int i;
+	int filerow;
+
+	// A long way ahead of the frontier is left to the worker; until it gets
+	// there those lines are drawn without colours.
+	int bottom = E.offset.Y + E.bufSize.Y;
+	double start = ClockNow();
+	double t = start;
+	if (!E.hl_worker || bottom - (int)E.hl_valid <= KILO_HL_SYNC_LINES)
+		EditorSyntaxCatchUp(bottom);
+	E.hl_pending = (E.hl_valid < E.linesnum && E.hl_valid < bottom);
+	E.time_hl += ClockNow() - t;
+
+	for (i = 0; i < E.bufSize.Y; ++i)
+	{
+		filerow = i + E.offset.Y;
+		if (filerow >= E.linesnum)
+		{
+			if (E.linesnum == 0 && i == E.bufSize.Y / 3)
+			{
+				char welcome[80];
+				int welcomelen = snprintf(
+					welcome, 
+					sizeof(welcome), 
+					"WinKilo Editor -- Version %s", 
+					KILO_VERSION
+				);
+				if (welcomelen > E.bufSize.X)
+					welcomelen = E.bufSize.X;
+				int padding = (E.bufSize.X - welcomelen) / 2;
+				if (padding)
+					ScreenPut(i, 0, "~", 1, 0);
+				ScreenPut(i, padding, welcome, welcomelen, 0);
+			}
+			else
+				ScreenPut(i, 0, "~", 1, 0);
+		}
+		else
+		{
+			line_t *line = EditorLine(filerow);
+			bool ready = filerow < E.hl_valid;
+			linedisp_t *d;
+			if (ready)
+			{
+				t = ClockNow();
+				d = EditorLineDisplay(filerow);
+				E.time_hl += ClockNow() - t;
+			}
+			else
+				d = EditorLineRender(line);
+			int len = (int)d->rsize - E.offset.X;
+			if (len < 0) len = 0;
+			if (len > E.bufSize.X) len = E.bufSize.X;
+			char *c = EditorDispText(line, d) + E.offset.X;
+			char *ch = &E.frame.ch[i * E.screen.X];
+			unsigned char *attr = &E.frame.attr[i * E.screen.X];
+			int j;
+			if (len > 0)
+				memcpy(ch, c, len);
+			if (ready)
+				EditorHlDraw(d, E.offset.X, attr, len);
+			for (j = 0; j < len; j++)
+			{
+				if (iscntrl(c[j]))
+				{
+					ch[j] = (c[j] <= 26) ? '@' + c[j] : '?';
+					attr[j] = ATTR_INVERSE;
+				}
+			}
+		}
+	}
+	EditorDrawMatches();
+	PerfEnd(PERF_DRAW, start);
+}
+
+void EditorDrawStatusBar(void)
+{
+	int len, rlen;
+	char status[80], rstatus[80], matches[48], saving[24] = "";
+
+	if (Save.running)
+		snprintf(saving, sizeof(saving), " saving %d%%", EditorSaveProgress());
+	len = snprintf(
+		status, 
+		sizeof(status), 
+		"%.20s - %d lines %s%s",
+		E.filename ? E.filename : "[UNTITLED]",
+		(int)E.linesnum,
+		E.dirty ? "(modified)" : "",
+		saving
+	);
+	EditorFindStatus(matches, sizeof(matches));
+	rlen = snprintf(
+		rstatus,
+		sizeof(rstatus),
+		"%s%s - %d/%d",
+		matches,
+		E.syntax ? E.syntax->filetype : "no ft",
+		E.cursor.Y + 1,
+		(int)E.linesnum
+	);
+	if (len > E.bufSize.X) 
+		len = E.bufSize.X;
+	memset(&E.frame.attr[E.bufSize.Y * E.screen.X], ATTR_INVERSE, E.screen.X);
+	ScreenPut(E.bufSize.Y, 0, status, len, ATTR_INVERSE);
+	if (len + rlen <= E.bufSize.X)
+		ScreenPut(E.bufSize.Y, E.bufSize.X - rlen, rstatus, rlen, ATTR_INVERSE);
+}
+
+void EditorDrawMessageBar(void)
+{
+	int msglen;
+	if (Perf.overlay)
+	{
+		char overlay[160];
+		msglen = PerfOverlay(overlay, sizeof(overlay));
+		if (msglen > E.bufSize.X)
+			msglen = E.bufSize.X;
+		ScreenPut(E.bufSize.Y + 1, 0, overlay, msglen, 0);
+		return;
+	}
+	msglen = strlen(E.statusmsg);
+	if (msglen > E.bufSize.X)
+		msglen = E.bufSize.X;
+	if (msglen && time(NULL) - E.statusmsg_time < 5)
+		ScreenPut(E.bufSize.Y + 1, 0, E.statusmsg, msglen, 0);
+}
+
+// The output buffer is kept across frames; after the first few it no
+// longer allocates.
+void EditorRefreshScreen(void)
+{
+	static struct abuf ab = ABUF_INIT;
+	double t = ClockNow();
+	ab.len = 0;
+	EditorScroll();
+	ScreenBegin();
+	EditorDrawLines();
+	EditorDrawStatusBar();
+	EditorDrawMessageBar();
+	bool wrote = ScreenFlush(&ab);
+
+	// The cursor only has to be placed again when cells were written or
+	// it moved.
+	pos_t cursor = { E.rx - E.offset.X, E.cursor.Y - E.offset.Y };
+	if (wrote || cursor.X != E.shown_cursor.X || cursor.Y != E.shown_cursor.Y)
+		abAppendCsi(&ab, cursor.Y + 1, cursor.X + 1, 'H');
+	if (wrote)
+		abAppend(&ab, "\x1b[?25h", 6);
+	E.shown_cursor = cursor;
+	if (E.term && ab.len)
+		E.term->write(ab.b, ab.len);
+	E.frame_bytes = ab.len;
+	E.frame_time = ClockNow();
+	E.time_refresh += E.frame_time - t;
+	PerfFrame();
+}
+
+void EditorSetStatusMessage(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+	va_end(ap);
+	E.statusmsg_time = time(NULL);
+}
+
+/*** Terminal Backends ***/
+#ifdef _WIN32
+// Windows console with virtual terminal sequences in both directions.
+// https://learn.microsoft.com/en-us/windows/console/reading-input-buffer-events
+struct Win32Console {
+	DWORD 	dwOutMode;	// Orignial stdout mode.
+	DWORD	dwInMode;	// Original stdin mode.
+	HANDLE 	hStdin;		// Stdin handle.
+	HANDLE	hStdout;	// Stdout handle.
+} W32;
+
+int Win32Init(void)
+{
+	DWORD dwMode;
+	CONSOLE_SCREEN_BUFFER_INFO csbi;
+
+	W32.hStdout = GetStdHandle(STD_OUTPUT_HANDLE);
+	W32.hStdin = GetStdHandle(STD_INPUT_HANDLE);
+
+	if (W32.hStdout == INVALID_HANDLE_VALUE)
+	{
+		fprintf(stderr, "Error: Invalid stdout handle value.\n");
+		return 0;
+	}
+
+	if (W32.hStdin == INVALID_HANDLE_VALUE)
+	{
+		fprintf(stderr, "Error: Invalid stdin handle value.\n");
+		return 0;
+	}
+    	
+	// Get console mode.
+    	if (!GetConsoleMode(W32.hStdout, &W32.dwOutMode))
+	{
+		fprintf(stderr, "Error: Can't get stdout handle mode (%d).\n", GetLastError());
+		return 0;
+	}
+
+	if (!GetConsoleMode(W32.hStdin, &W32.dwInMode))
+	{
+		fprintf(stderr, "Error: Can't get stdin handle mode (%d).\n", GetLastError());
+		return 0;
+	}
+
+	// Enable virtual terminal sequences.
+	dwMode = W32.dwOutMode;
+	dwMode |= ENABLE_PROCESSED_OUTPUT; 
+	dwMode |= ENABLE_VIRTUAL_TERMINAL_PROCESSING;
+
+    	if (!SetConsoleMode(W32.hStdout, dwMode))
+	{
+		fprintf(stderr, "Error: Can't set stdout handle mode (%d).\n", GetLastError());
+		return 0;
+	}
+
+	// Enable mouse and key input events.
+	W32.dwInMode &= (~ENABLE_VIRTUAL_TERMINAL_INPUT);
+	W32.dwInMode |= ENABLE_ECHO_INPUT;
+	W32.dwInMode |= ENABLE_LINE_INPUT;
+	W32.dwInMode |= ENABLE_PROCESSED_INPUT;
+	W32.dwInMode |= ENABLE_QUICK_EDIT_MODE;
+
+	dwMode = W32.dwInMode;
+
+	dwMode &= (~ENABLE_ECHO_INPUT);		// Required to prevent characters from showing
+	dwMode &= (~ENABLE_LINE_INPUT);		// Required to process every single character without pressing 'Enter'
+	dwMode &= (~ENABLE_PROCESSED_INPUT);	// Disable Ctrl-C
+	dwMode |= ENABLE_EXTENDED_FLAGS; 
+	dwMode |= ENABLE_WINDOW_INPUT; 
+	dwMode |= ENABLE_VIRTUAL_TERMINAL_INPUT;
+
+	if (!SetConsoleMode(W32.hStdin, dwMode))
+	{
+		fprintf(stderr, "Error: Can't set stdin handle mode (%d).\n", GetLastError());
+		return 0;
+	}
+
+	// Switch to a new alternate screen buffer.
+	printf("\x1b[?1049h");
+	printf("\x1b[?2004h");	// Bracketed paste.
+	printf("\x1b]0;%s\x07", KILO_TITLE);
+
+	// Retrieves information about the current console screen buffer.
+	GetConsoleScreenBufferInfo(W32.hStdout, &csbi);
+	E.bufSize.Y = csbi.dwSize.Y - 2;
+	E.bufSize.X = csbi.dwSize.X; 
+	return 1;
+}
+
+void Win32Exit(void)
+{
+	// Reset console settings.
+	if (W32.hStdout != INVALID_HANDLE_VALUE && W32.dwOutMode)
+	{
+		printf("\x1b[?2004l");	// Bracketed paste off.
+		printf("\x1b[!p");	// Reset console settings.
+		printf("\x1b[?1049l");	// Switch back to the main buffer.
+		fflush(stdout);
+		SetConsoleMode(W32.hStdout, W32.dwOutMode);
+	}
+
+	if (W32.hStdin != INVALID_HANDLE_VALUE && W32.dwInMode)
+	{
+		SetConsoleMode(W32.hStdin, W32.dwInMode);
+	}
+}
+
+bool Win32Wait(int ms)
+{
+	return WaitForSingleObject(W32.hStdin, ms < 0 ? INFINITE : ms) == WAIT_OBJECT_0;
+}
+
+// Turns one batch of console records into bytes. Held keys are reported
+// once with a repeat count and come out that many times.
+int Win32Read(char *buf, int size)
+{
+	DWORD i, cInRead;
+	INPUT_RECORD irInBuf[MAXINREC];
+	int len = 0;
+
+	if (!ReadConsoleInput(W32.hStdin, irInBuf, MAXINREC, &cInRead))
+		return -1;
+
+	for (i = 0; i < cInRead; ++i)
+	{
+		switch (irInBuf[i].EventType)
+		{
+			case KEY_EVENT:
+				if (!irInBuf[i].Event.KeyEvent.bKeyDown)
+					continue;
+
+				int repeat = irInBuf[i].Event.KeyEvent.wRepeatCount;
+				do
+					if (len < size)
+						buf[len++] = irInBuf[i].Event.KeyEvent.uChar.AsciiChar;
+				while (--repeat > 0);
+				break;
+
+			case WINDOW_BUFFER_SIZE_EVENT:
+				E.bufSize.X = irInBuf[i].Event.WindowBufferSizeEvent.dwSize.X; 
+				E.bufSize.Y = irInBuf[i].Event.WindowBufferSizeEvent.dwSize.Y - 2;
+				break;
+		}
+	}
+	return len;
+}
+
+void Win32Write(const char *buf, int len)
+{
+	fwrite(buf, 1, len, stdout);
+	fflush(stdout);
+}
+
+struct TerminalBackend Win32Backend = {
+	"win32", Win32Init, Win32Exit, Win32Wait, Win32Read, Win32Write
+};
+#else
+// A VT terminal on a POSIX tty in raw mode.
+struct PosixTerminal {
+	struct termios orig;	// Terminal settings to restore.
+	bool raw;
+	volatile sig_atomic_t resized;
+} PT;
+
+void PosixOnResize(int sig)
+{
+	PT.resized = 1;
+}
+
+void PosixUpdateSize(void)
+{
+	struct winsize ws;
+
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+	{
+		ws.ws_col = 80;
+		ws.ws_row = 24;
+	}
+	E.bufSize.X = ws.ws_col;
+	E.bufSize.Y = ws.ws_row - 2;
+}
+
+void PosixWrite(const char *buf, int len)
+{
+	while (len > 0)
+	{
+		ssize_t n = write(STDOUT_FILENO, buf, len);
+		if (n == -1 && errno == EINTR) continue;
+		if (n <= 0) return;
+		buf += n;
+		len -= n;
+	}
+}
+
+int PosixInit(void)
+{
+	struct termios raw;
+	struct sigaction sa;
+	char buf[64];
+
+	if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &PT.orig) == -1)
+	{
+		fprintf(stderr, "Error: stdin is not a terminal.\n");
+		return 0;
+	}
+
+	raw = PT.orig;
+	raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+	raw.c_oflag &= ~(OPOST);
+	raw.c_cflag |= (CS8);
+	raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+	raw.c_cc[VMIN] = 1;
+	raw.c_cc[VTIME] = 0;
+	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
+	{
+		fprintf(stderr, "Error: Can't set raw mode (%d).\n", errno);
+		return 0;
+	}
+	PT.raw = true;
+
+	// No SA_RESTART: a resize interrupts a blocking read.
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = PosixOnResize;
+	sigaction(SIGWINCH, &sa, NULL);
+
+	int len = snprintf(buf, sizeof(buf), "\x1b[?1049h\x1b[?2004h\x1b]0;%s\x07", KILO_TITLE);
+	PosixWrite(buf, len);
+	PosixUpdateSize();
+	return 1;
+}
+
+void PosixExit(void)
+{
+	if (!PT.raw) return;
+	PosixWrite("\x1b[?2004l\x1b[m\x1b[?1049l", 21);
+	tcsetattr(STDIN_FILENO, TCSAFLUSH, &PT.orig);
+	PT.raw = false;
+}
+
+bool PosixWait(int ms)
+{
+	struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+
+	if (PT.resized) return true;
+	int n = poll(&pfd, 1, ms);
+	return n > 0 || PT.resized;
+}
+
+int PosixRead(char *buf, int size)
+{
+	if (PT.resized)
+	{
+		PT.resized = 0;
+		PosixUpdateSize();
+		if (!PosixWait(0))
+			return 0;
+	}
+
+	ssize_t n = read(STDIN_FILENO, buf, size);
+	if (n == -1 && errno == EINTR)
+		return 0;
+	return n;
+}
+
+struct TerminalBackend PosixBackend = {
+	"posix", PosixInit, PosixExit, PosixWait, PosixRead, PosixWrite
+};
+#endif
+
+// Replays scripted input from memory and captures the output, for tests,
+// benchmarks and profiling without a terminal. The screen size comes from
+// $COLUMNS and $LINES, 80x24 by default. The editor exits once the script
+// has been read and the last frame drawn.
+struct Headless {
+	char *input;
+	size_t inputlen;
+	size_t pos;
+	size_t chunk;	// Most bytes handed out per read, 0 for all. Tests set it to split input.
+	FILE *capture;	// Receives the output, NULL to drop it.
+	size_t *events;	// End offsets of the key events, NULL to hand out input freely.
+	size_t nevents;
+	size_t event;	// Next event to start.
+	void (*onevent)(void);	// Called as each event starts being read.
+} Headless;
+
+int HeadlessInit(void)
+{
+	char *cols = getenv("COLUMNS");
+	char *rows = getenv("LINES");
+
+	E.bufSize.X = (cols && atoi(cols) > 0) ? atoi(cols) : 80;
+	E.bufSize.Y = ((rows && atoi(rows) > 2) ? atoi(rows) : 24) - 2;
+	return 1;
+}
+
+void HeadlessExit(void)
+{
+	if (Headless.capture)
+		fclose(Headless.capture);
+	Headless.capture = NULL;
+}
+
+// With events, input stops at the end of each one until it is read again,
+// so every event gets a frame of its own.
+bool HeadlessWait(int ms)
+{
+	if (Headless.events && Headless.event > 0 && Headless.pos == Headless.events[Headless.event - 1])
+		return false;
+	return Headless.pos < Headless.inputlen;
+}
+
+int HeadlessRead(char *buf, int size)
+{
+	size_t n = Headless.inputlen - Headless.pos;
+
+	if (n == 0)
+		return -2;
+	if (Headless.events)
+	{
+		if (Headless.event == 0 || Headless.pos == Headless.events[Headless.event - 1])
+		{
+			if (Headless.onevent)
+				Headless.onevent();
+			Headless.event++;
+		}
+		n = Headless.events[Headless.event - 1] - Headless.pos;
+	}
+	if (Headless.chunk && n > Headless.chunk)
+		n = Headless.chunk;
+	if (n > (size_t)size)
+		n = size;
+	memcpy(buf, &Headless.input[Headless.pos], n);
+	Headless.pos += n;
+	return n;
+}
+
+void HeadlessWrite(const char *buf, int len)
+{
+	if (Headless.capture)
+		fwrite(buf, 1, len, Headless.capture);
+}
+
+struct TerminalBackend HeadlessBackend = {
+	"headless", HeadlessInit, HeadlessExit, HeadlessWait, HeadlessRead, HeadlessWrite
+};
+
+// Loads the script for the headless backend: the raw bytes a terminal
+// would send, "-" for stdin. Output goes to capture unless it is NULL.
+int HeadlessLoad(char *script, char *capture)
+{
+	FILE *fp = strcmp(script, "-") ? fopen(script, "rb") : stdin;
+	size_t cap = 0;
+	size_t n;
+
+	if (fp == NULL)
+	{
+		fprintf(stderr, "Can't open %s: %s\n", script, strerror(errno));
+		return 0;
+	}
+	do
+	{
+		if (Headless.inputlen == cap)
+		{
+			cap = cap ? cap * 2 : 4096;
+			Headless.input = realloc(Headless.input, cap);
+		}
+		n = fread(&Headless.input[Headless.inputlen], 1, cap - Headless.inputlen, fp);
+		Headless.inputlen += n;
+	} while (n > 0);
+	if (fp != stdin)
+		fclose(fp);
+
+	if (capture && (Headless.capture = fopen(capture, "wb")) == NULL)
+	{
+		fprintf(stderr, "Can't open %s: %s\n", capture, strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+/*** Input ***/
+// Returns the text entered, or NULL if cancelled. Enter is ignored on an
+// empty line unless empty is set.
+char *EditorPrompt(char *prompt, void (*callback)(char *, int), bool empty)
+{
+	int c;
+	size_t bufsize = 128;
+	char *buf = malloc(bufsize);
+
+	size_t buflen = 0;
+	buf[0] = '\0';
+
+	while (1)
+	{
+		EditorSetStatusMessage(prompt, buf);
+		EditorRefreshScreen();
+
+		c = HandleInputs();
+
+		if (!c) continue;
+
+		if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE)
+		{
+			if (buflen != 0)
+				buf[--buflen] = '\0';
+		}
+		if (c == '\x1b' || c == INPUT_END)
+		{
+			EditorSetStatusMessage("");
+			if (callback)
+				callback(buf, '\x1b');
+			free(buf);
+			return NULL;
+		}
+		else if (c == '\r')
+		{
+			if (buflen != 0 || empty)
+			{
+				EditorSetStatusMessage("");
+				if (callback)
+					callback(buf, c);
+				return buf;
+			}
+		}
+		else if (!iscntrl(c) && c < 128)
+		{
+			if (buflen == bufsize - 1)
+			{
+				bufsize *= 2;
+				buf = realloc(buf, bufsize);
+			}
+			buf[buflen++] = c;
+			buf[buflen] = '\0';
+		}
+		else if (c == PASTE_TEXT)
+		{
+			for (size_t j = 0; j < E.input.pastelen; j++)
+			{
+				char ch = E.input.paste[j];
+				if (iscntrl(ch)) continue;
+				if (buflen == bufsize - 1)
+				{
+					bufsize *= 2;
+					buf = realloc(buf, bufsize);
+				}
+				buf[buflen++] = ch;
+			}
+			buf[buflen] = '\0';
+		}
+
+		if (callback)
+			callback(buf, c);
+	}
+}
+
+void EditorMoveCursor(int key)
+{
+	line_t *line = (E.cursor.Y >= E.linesnum) ? NULL : EditorLine(E.cursor.Y);
+
+	switch (key)
+	{
+		case ARROW_LEFT:
+			if (E.cursor.X != 0)
+				E.cursor.X--;
+			else if (E.cursor.Y > 0)
+			{
+				E.cursor.Y--;
+				E.cursor.X = EditorLine(E.cursor.Y)->size;
+			}
+			break;
+		case ARROW_RIGHT:
+			if (line && E.cursor.X < line->size)
+				E.cursor.X++;
+			else if (line && E.cursor.X == line->size)
+			{
+				E.cursor.X = 0;
+				E.cursor.Y++;
+			}
+			break;
+		case ARROW_UP:
+			if (E.cursor.Y != 0)
+				E.cursor.Y--;
+			break;
+		case ARROW_DOWN:
+			if (E.cursor.Y < E.linesnum)
+				E.cursor.Y++;
+			break;
+	}
+
+	line = (E.cursor.Y >= E.linesnum) ? NULL : EditorLine(E.cursor.Y);
+	int linelen = line ? line->size : 0;
+	if (E.cursor.X > linelen) E.cursor.X = linelen;
+}
+
+void HandleKeyPress(void)
+{
+	static int quit_times = KILO_QUIT_TIMES;
+
+	int c = HandleInputs();
+
+	Undo.step++;
+	switch (c)
+	{
+		case 0: 
+			// Ignore Shift and Ctrl keys
+			// Requied to prevent reseting quit_times
+			return;
+			break;
+		case '\r':
+			EditorInsertNewLine();
+			break;
+		case CTRL_KEY('q'):
+			EditorSaveFinish(true);
+			if (E.dirty && quit_times > 0)
+			{
+				EditorSetStatusMessage(
+					"WARNING: File has unsaved changes. " 
+					"Press Ctrl-Q %d more times to quit.",
+					quit_times
+				);
+				quit_times--;
+				return;
+			}
+			JournalClose(true);
+			exit(0);
+			break;
+		case INPUT_END:
+			// Quits like Ctrl-Q, but keeps the journal of unsaved edits.
+			exit(E.input.failed);
+			break;
+		case CTRL_KEY('s'):
+			EditorSave();
+			break;
+		case HOME_KEY:
+			E.cursor.X = 0;
+			break;
+		case END_KEY:
+			if (E.cursor.Y < E.linesnum)
+				E.cursor.X = EditorLine(E.cursor.Y)->size;
+			break;
+		case CTRL_KEY('f'):
+			EditorFind();
+			break;
+		case CTRL_KEY('r'):
+			EditorReplace();
+			break;
+		case BACKSPACE:
+		case CTRL_KEY('h'):
+		case DEL_KEY:
+			if (c == DEL_KEY)
+				EditorMoveCursor(ARROW_RIGHT);
+			EditorDelChar();
+			break;
+		case PAGE_UP:
+		case PAGE_DOWN:
+			{
+				if (c == PAGE_UP)
+				{
+					E.cursor.Y = E.offset.Y;
+				}
+				else if (c == PAGE_DOWN)
+				{
+					E.cursor.Y = E.offset.Y + E.bufSize.Y - 1;
+					if (E.cursor.Y > E.linesnum)
+						E.cursor.Y = E.linesnum;
+				}
+				int times = E.bufSize.Y;
+				while (times--)
+					EditorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+			}
+			break;
+		case ARROW_UP:
+		case ARROW_DOWN:
+		case ARROW_LEFT:
+		case ARROW_RIGHT:
+			EditorMoveCursor(c);
+			break;
+		case PASTE_TEXT:
+			EditorInsertText(E.input.paste, E.input.pastelen);
+			break;
+		case CTRL_KEY('p'):
+			Perf.overlay = !Perf.overlay;
+			break;
+		case CTRL_KEY('z'):
+			EditorUndo();
+			break;
+		case CTRL_KEY('y'):
+			EditorRedo();
+			break;
+		case CTRL_KEY('l'):
+		case '\x1b':
+			break;
+		default:
+			EditorInsertChar(c);
+			break;
 	}
+
+	quit_times = KILO_QUIT_TIMES;
 }
 
-/*** Append Buffer ***/
-struct abuf {
-	char *b;
-	int len;
-};
+void EditorQueueKey(int c)
+{
+	struct KeyQueue *q = &E.input;
 
-#define ABUF_INIT {NULL, 0}
+	if (q->len == q->cap)
+	{
+		q->cap = q->cap ? q->cap * 2 : 256;
+		q->keys = PerfRealloc(q->keys, sizeof(int) * q->cap);
+	}
+	q->keys[q->len++] = c;
+}
 
-void abAppend(struct abuf *ab, const char *s, int len)
+void EditorQueueText(char c, int repeat)
 {
-	char *new = realloc(ab->b, ab->len + len);
+	struct KeyQueue *q = &E.input;
 
-	if (new == NULL) return;
-	memcpy(&new[ab->len], s, len);
-	ab->b = new;
-	ab->len += len;
+	if (q->textlen + repeat > q->textcap)
+	{
+		while (q->textlen + repeat > q->textcap)
+			q->textcap = q->textcap ? q->textcap * 2 : 4096;
+		q->text = PerfRealloc(q->text, q->textcap);
+	}
+	memset(&q->text[q->textlen], c, repeat);
+	q->textlen += repeat;
 }
 
-void abFree(struct abuf *ab)
+// Queues the text collected since the last key: as one PASTE_TEXT when it
+// was pasted or is long enough to have been, else as separate keys.
+void EditorQueueRun(bool paste)
 {
-	free(ab->b);
+	struct KeyQueue *q = &E.input;
+	size_t n = q->textlen - q->run;
+
+	if (n == 0) return;
+	if (paste || n >= KILO_PASTE_RUN)
+	{
+		EditorQueueKey(PASTE_TEXT);
+		EditorQueueKey(q->run);
+		EditorQueueKey(n);
+		q->run = q->textlen;
+	}
+	else
+	{
+		for (size_t j = q->run; j < q->textlen; j++)
+			EditorQueueKey((unsigned char)q->text[j]);
+		q->textlen = q->run;
+	}
 }
 
-/*** Output ***/
-void EditorScroll(void)
+// Whether the n bytes at s, starting with ESC, are the start of an escape
+// sequence that goes on past them.
+bool EscapeCut(const char *s, int n)
 {
-	E.rx = E.cursor.X;
-	if (E.cursor.Y < E.linesnum)
-		E.rx = EditorLineCxToRx(&E.line[E.cursor.Y], E.cursor.X);
-
-	if (E.cursor.Y < E.offset.Y)
-		E.offset.Y = E.cursor.Y;
-	if (E.cursor.Y >= E.offset.Y + E.bufSize.Y)
-		E.offset.Y = E.cursor.Y - E.bufSize.Y + 1;
-	if (E.rx < E.offset.X)
-		E.offset.X = E.rx;
-	if (E.rx >= E.offset.X + E.bufSize.X)
-		E.offset.X = E.rx - E.bufSize.X + 1;
+	int j = 2;
+
+	if (n < 2) return true;
+	if (s[1] != '[' && s[1] != 'O') return false;
+	if (n < 3) return true;
+	if (s[1] == 'O' || !isdigit((unsigned char)s[2])) return false;
+	while (j < n && isdigit((unsigned char)s[j]))
+		j++;
+	return j == n;
 }
 
-void EditorDrawLines(struct abuf *ab)
+// Decodes input bytes into the key queue. Plain text is collected into
+// runs, see EditorQueueRun. Unless final is set, an escape sequence cut off
+// at the end is kept in E.input.carry for the next read to complete.
+void EditorQueueBytes(const char *buf, int len, bool final)
 {
+	int c;
 	int i;
-	int filerow;
-	for (i = 0; i < E.bufSize.Y; ++i)
+
+	for (i = 0; i < len; ++i)
 	{
-		filerow = i + E.offset.Y;
-		if (filerow >= E.linesnum)
+		c = (unsigned char)buf[i];
+		if (c == 0)
+			continue;
+
+		if (c == '\x1b' && !final && len - i <= (int)sizeof(E.input.carry) && EscapeCut(&buf[i], len - i))
 		{
-			if (E.linesnum == 0 && i == E.bufSize.Y / 3)
-			{
-				char welcome[80];
-				int welcomelen = snprintf(
-					welcome, 
-					sizeof(welcome), 
-					"WinKilo Editor -- Version %s", 
-					KILO_VERSION
-				);
-				if (welcomelen > E.bufSize.X)
-					welcomelen = E.bufSize.X;
-				int padding = (E.bufSize.X - welcomelen) / 2;
-				if (padding)
-				{
-					abAppend(ab, "~", 1);
-					padding--;
-				}
-				while (padding--)
-					abAppend(ab, " ", 1);
-				abAppend(ab, welcome, welcomelen);
-			}
-			else
-				abAppend(ab, "~", 1);
+			memcpy(E.input.carry, &buf[i], len - i);
+			E.input.carrylen = len - i;
+			return;
 		}
-		else
+
+		if (c == '\x1b' && i + 2 < len)
 		{
-			int len = E.line[filerow].rsize - E.offset.X;
-			if (len < 0) len = 0;
-			if (len > E.bufSize.X) len = E.bufSize.X;
-			char *c = &E.line[filerow].render[E.offset.X];
-			unsigned char *hl = &E.line[filerow].hl[E.offset.X];
-			int current_color = -1;
-			int j;
-			for (j = 0; j < len; j++)
+			char seq[3];
+			seq[0] = buf[i + 1];
+			seq[1] = buf[i + 2];
+
+			if (seq[0] == '[')
 			{
-				if (iscntrl(c[j]))
+				i += 2;
+				if (seq[1] >= '0' && seq[1] <= '9')
 				{
-					char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-					abAppend(ab, "\x1b[7m", 4);
-					abAppend(ab, &sym, 1);
-					abAppend(ab, "\x1b[m", 3);
-					if (current_color != -1)
+					int num = seq[1] - '0';
+					while (i + 1 < len && isdigit((unsigned char)buf[i + 1]))
+						num = num * 10 + buf[++i] - '0';
+					seq[2] = (i + 1 < len) ? buf[++i] : 0;
+
+					if (seq[2] == '~')
 					{
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-						abAppend(ab, buf, clen);
+						switch (num)
+						{
+							case 1: c = HOME_KEY; break;
+							case 3: c = DEL_KEY; break;
+							case 4: c = END_KEY; break;
+							case 5: c = PAGE_UP; break;
+							case 6: c = PAGE_DOWN; break;
+							case 7: c = HOME_KEY; break;
+							case 8: c = END_KEY; break;
+							case 200: c = PASTE_BEGIN; break;
+							case 201: c = PASTE_END; break;
+						}
 					}
 				}
-				else if (hl[j] == HL_NORMAL)
+				else
 				{
-					if (current_color != -1)
+					switch (seq[1])
 					{
-						abAppend(ab, "\x1b[39m", 5);
-						current_color = -1;
+						case 'A': c = ARROW_UP; break;
+						case 'B': c = ARROW_DOWN; break;
+						case 'C': c = ARROW_RIGHT; break;
+						case 'D': c = ARROW_LEFT; break;
+						case 'H': c = HOME_KEY; break;
+						case 'F': c = END_KEY; break;
 					}
-					abAppend(ab, &c[j], 1);
 				}
-				else
+			}
+			else if (seq[0] == 'O')
+			{
+				i += 2;
+				switch (seq[1])
 				{
-					int color = EditorSyntaxToColor(hl[j]);
-					if (color != current_color)
-					{
-						current_color = color;
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-						abAppend(ab, buf, clen);
-					}
-					abAppend(ab, &c[j], 1);
+					case 'H': c = HOME_KEY; break;
+					case 'F': c = END_KEY; break;
 				}
 			}
-			abAppend(ab, "\x1b[39m", 5);
 		}
-		abAppend(ab, "\x1b[K", 3);
-		abAppend(ab, "\r\n", 2);
-	}
-}
-
-void EditorDrawStatusBar(struct abuf *ab)
-{
-	int len, rlen;
-	char status[80], rstatus[80];
 
-	abAppend(ab, "\x1b[7m", 4);
-	len = snprintf(
-		status, 
-		sizeof(status), 
-		"%.20s - %d lines %s",
-		E.filename ? E.filename : "[UNTITLED]",
-		E.linesnum,
-		E.dirty ? "(modified)" : ""
-	);
-	rlen = snprintf(
-		rstatus,
-		sizeof(rstatus),
-		"%s - %d/%d",
-		E.syntax ? E.syntax->filetype : "no ft",
-		E.cursor.Y + 1,
-		E.linesnum
-	);
-	if (len > E.bufSize.X) 
-		len = E.bufSize.X;
-	abAppend(ab, status, len);
-	while (len < E.bufSize.X)
-	{
-		if (E.bufSize.X - len == rlen)
+		if (E.input.pasting && c != PASTE_END)
 		{
-			abAppend(ab, rstatus, rlen);
-			break;
+			EditorQueueText(c, 1);
+		}
+		else if (c == PASTE_END)
+		{
+			EditorQueueRun(true);
+			E.input.pasting = false;
+		}
+		else if ((c >= ' ' && c < 127) || c == '\t' || c == '\r')
+		{
+			EditorQueueText(c, 1);
 		}
 		else
 		{
-			abAppend(ab, " ", 1);
-			len++;
+			EditorQueueRun(false);
+			if (c == PASTE_BEGIN)
+				E.input.pasting = true;
+			else
+				EditorQueueKey(c);
 		}
 	}
-	abAppend(ab, "\x1b[m", 3);
-	abAppend(ab, "\r\n", 2);
-}
-
-void EditorDrawMessageBar(struct abuf *ab)
-{
-	int msglen;
-	abAppend(ab, "\x1b[K", 3);
-	msglen = strlen(E.statusmsg);
-	if (msglen > E.bufSize.X)
-		msglen = E.bufSize.X;
-	if (msglen && time(NULL) - E.statusmsg_time < 5)
-		abAppend(ab, E.statusmsg, msglen);
 }
 
-void EditorRefreshScreen(void)
+// Whether a key is queued or input arrives within ms.
+bool EditorInputPending(int ms)
 {
-	char buf[32];
-	struct abuf ab = ABUF_INIT;
-	EditorScroll();
-	abAppend(&ab, "\x1b[?25l", 6);
-	abAppend(&ab, "\x1b[H", 3);
-	EditorDrawLines(&ab);
-	EditorDrawStatusBar(&ab);
-	EditorDrawMessageBar(&ab);
-	snprintf(buf, 
-		sizeof(buf), 
-		"\x1b[%d;%dH", 
-		(E.cursor.Y - E.offset.Y) + 1,
-		(E.rx - E.offset.X) + 1
-	);
-	abAppend(&ab, buf, strlen(buf));
-	abAppend(&ab, "\x1b[?25h", 6);
-	fwrite(ab.b, 1, ab.len, stdout);
-	abFree(&ab);
-}
+	if (E.input.head < E.input.len) return true;
 
-void EditorSetStatusMessage(const char *fmt, ...)
-{
-	va_list ap;
-	va_start(ap, fmt);
-	vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
-	va_end(ap);
-	E.statusmsg_time = time(NULL);
+	EditorUnlock();
+	bool ready = E.term->wait(ms);
+	EditorLock();
+	return ready;
 }
 
-/*** Input ***/
-char *EditorPrompt(char *prompt, void (*callback)(char *, int))
+// Returns the next key, reading everything the terminal has when the queue
+// is empty. Returns 0 when the input read holds no key. The text of a
+// PASTE_TEXT is left in E.input.paste until the next call.
+int HandleInputs(void)
 {
-	int c;
-	size_t bufsize = 128;
-	char *buf = malloc(bufsize);
-
-	size_t buflen = 0;
-	buf[0] = '\0';
+	char buf[BUFF_MAX * 4];
+	int n;
+	struct KeyQueue *q = &E.input;
 
-	while (1)
+	if (q->head == q->len)
 	{
-		EditorSetStatusMessage(prompt, buf);
-		EditorRefreshScreen();
-
-		c = HandleInputs();
-
-		if (!c) continue;
-
-		if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE)
+		// Only a bracketed paste still being read has text left.
+		if (q->run)
 		{
-			if (buflen != 0)
-				buf[--buflen] = '\0';
+			memmove(q->text, &q->text[q->run], q->textlen - q->run);
+			q->textlen -= q->run;
+			q->run = 0;
 		}
-		if (c == '\x1b')
+		q->head = q->len = 0;
+
+		EditorUnlock();
+
+		// Redraw now and then while the worker catches up with the screen,
+		// or to show how far a save got.
+		if ((E.hl_pending || Save.running) && !E.term->wait(KILO_HL_POLL_MS))
 		{
-			EditorSetStatusMessage("");
-			if (callback)
-				callback(buf, c);
-			free(buf);
-			return NULL;
+			EditorLock();
+			return 0;
 		}
-		else if (c == '\r')
+
+		// The rest of an escape sequence cut off by a read follows at once,
+		// so when nothing comes it was a lone ESC after all.
+		do
 		{
-			if (buflen != 0)
+			memcpy(buf, q->carry, q->carrylen);
+			n = q->ended ? -2 : E.term->read(buf + q->carrylen, sizeof(buf) - q->carrylen);
+			if (n < 0)
 			{
-				EditorSetStatusMessage("");
-				if (callback)
-					callback(buf, c);
-				return buf;
+				if (n == -1)
+					fprintf(stderr, "Error read input events: (%d)\n", LastError());
+				q->failed = q->failed || n == -1;
+				q->ended = true;
+				n = 0;
 			}
+			n += q->carrylen;
+			q->carrylen = 0;
+			EditorQueueBytes(buf, n, false);
+		} while (!q->ended && (q->carrylen ? E.term->wait(KILO_ESC_WAIT_MS) : (n > 0 && E.term->wait(0))));
+		if (q->carrylen)
+		{
+			n = q->carrylen;
+			memcpy(buf, q->carry, n);
+			q->carrylen = 0;
+			EditorQueueBytes(buf, n, true);
 		}
-		else if (!iscntrl(c) && c < 128)
+		EditorLock();
+
+		if (!q->pasting || q->ended)
+			EditorQueueRun(q->pasting);
+		if (q->ended)
+			EditorQueueKey(INPUT_END);
+		if (q->len == 0) return 0;
+	}
+
+	int c = q->keys[q->head++];
+	if (c == PASTE_TEXT)
+	{
+		q->paste = &q->text[q->keys[q->head++]];
+		q->pastelen = q->keys[q->head++];
+	}
+	return c;
+}
+
+// Handles keys until the input runs dry, then returns to have the screen
+// drawn once for all of them. Input arriving before the next frame is due
+// under KILO_FRAME_RATE is taken in as well.
+void EditorProcessInput(void)
+{
+	double wait;
+
+	EditorSaveFinish(false);
+	do
+	{
+		HandleKeyPress();
+		while (EditorInputPending(0))
+			HandleKeyPress();
+		wait = E.frame_time + 1.0 / KILO_FRAME_RATE - ClockNow();
+	} while (wait > 0 && EditorInputPending((int)(wait * 1000)));
+}
+
+/*** Benchmarks ***/
+
+// The line splitting loop EditorOpen used before files were mapped.
+size_t BenchFgetsLines(char *filename)
+{
+	FILE *fp = fopen(filename, "r");
+	if (!fp) return 0;
+
+	char buf[64];
+	char *line = NULL;
+	size_t nread, lines = 0;
+	size_t linelen = 0;
+	size_t linecap = 0;
+	bool newline = false;
+
+	while (fgets(buf, sizeof(buf), fp) != NULL)
+	{
+		nread = strlen(buf);
+		while (nread > 0 && (buf[nread - 1] == '\n' || buf[nread - 1] == '\r'))
 		{
-			if (buflen == bufsize - 1)
-			{
-				bufsize *= 2;
-				buf = realloc(buf, bufsize);
-			}
-			buf[buflen++] = c;
-			buf[buflen] = '\0';
+			nread--;
+			newline = true;
+		}
+
+		if (linecap < linelen + nread)
+		{
+			line = realloc(line, linelen + nread);
+			linecap = linelen + nread;
 		}
 
-		if (callback)
-			callback(buf, c);
+		memcpy(&line[linelen], buf, nread);
+		linelen += nread;
+
+		if (newline)
+		{
+			lines++;
+			newline = false;
+			linelen = 0;
+		}
 	}
+
+	free(line);
+	fclose(fp);
+	return lines + 1;
 }
 
-void EditorMoveCursor(int key)
+int BenchWriteInput(char *filename, size_t size, size_t linelen)
 {
-	line_t *line = (E.cursor.Y >= E.linesnum) ? NULL : &E.line[E.cursor.Y];
+	FILE *fp = fopen(filename, "wb");
+	if (!fp) return 0;
 
-	switch (key)
+	char chunk[1 << 16];
+	for (size_t j = 0; j < sizeof(chunk); j++)
+		chunk[j] = (j % (linelen + 1) == linelen) ? '\n' : 'a' + j % 26;
+
+	// Chunks are cut at a line boundary so every line has the same length.
+	size_t whole = sizeof(chunk) - sizeof(chunk) % (linelen + 1);
+	for (size_t done = 0; done < size; done += whole)
 	{
-		case ARROW_LEFT:
-			if (E.cursor.X != 0)
-				E.cursor.X--;
-			else if (E.cursor.Y > 0)
-			{
-				E.cursor.Y--;
-				E.cursor.X = E.line[E.cursor.Y].size;
-			}
-			break;
-		case ARROW_RIGHT:
-			if (line && E.cursor.X < line->size)
-				E.cursor.X++;
-			else if (line && E.cursor.X == line->size)
-			{
-				E.cursor.X = 0;
-				E.cursor.Y++;
-			}
-			break;
-		case ARROW_UP:
-			if (E.cursor.Y != 0)
-				E.cursor.Y--;
-			break;
-		case ARROW_DOWN:
-			if (E.cursor.Y < E.linesnum)
-				E.cursor.Y++;
-			break;
+		size_t n = (size - done < whole) ? size - done : whole;
+		if (fwrite(chunk, 1, n, fp) != n)
+		{
+			fclose(fp);
+			return 0;
+		}
 	}
+	fclose(fp);
+	return 1;
+}
 
-	line = (E.cursor.Y >= E.linesnum) ? NULL : &E.line[E.cursor.Y];
-	int linelen = line ? line->size : 0;
-	if (E.cursor.X > linelen) E.cursor.X = linelen;
+void BenchResetLines(void)
+{
+	E.linesnum = 0;
+	E.gap = 0;
+	E.hl_valid = 0;
 }
 
-void HandleKeyPress(void)
+// winkilo --bench-scan [MB ...]
+// Compares the old fgets loop with every newline scanner on generated files
+// of short (16 byte) and long (4 KB) lines. Defaults to 100, 1024 and 4096 MB.
+int BenchScan(int argc, char *argv[])
 {
-	static int quit_times = KILO_QUIT_TIMES;
+	char *filename = "winkilo-bench.tmp";
+	size_t defaults[] = { 100, 1024, 4096 };
+	size_t linelens[] = { 16, 4096 };
+	int nsizes = argc ? argc : 3;
+	int threads = ThreadCount();
+	char par[16];
+
+	snprintf(par, sizeof(par), "par(x%d)", threads);
+	printf("%-8s %-6s %10s", "size_mb", "lines", "fgets");
+	for (unsigned int s = 0; s < NLSCANNERS_ENTRIES; s++)
+		printf(" %10s", NLSCANNERS[s].name);
+	printf(" %10s\n", par);
+
+	for (int i = 0; i < nsizes; i++)
+	{
+		size_t mb = argc ? strtoul(argv[i], NULL, 10) : defaults[i];
+		for (int l = 0; l < 2; l++)
+		{
+			if (!BenchWriteInput(filename, mb << 20, linelens[l]))
+			{
+				fprintf(stderr, "Can't write %s: %s\n", filename, strerror(errno));
+				return 1;
+			}
 
-	int c = HandleInputs();
+			double t = ClockNow();
+			BenchFgetsLines(filename);
+			printf("%-8zu %-6s %8.0fms", mb, l ? "long" : "short", (ClockNow() - t) * 1000);
 
-	switch (c)
-	{
-		case 0: 
-			// Ignore Shift and Ctrl keys
-			// Requied to prevent reseting quit_times
-			return;
-			break;
-		case '\r':
-			EditorInsertNewLine();
-			break;
-		case CTRL_KEY('q'):
-			if (E.dirty && quit_times > 0)
+			if (!EditorMapFile(filename))
 			{
-				EditorSetStatusMessage(
-					"WARNING: File has unsaved changes. " 
-					"Press Ctrl-Q %d more times to quit.",
-					quit_times
-				);
-				quit_times--;
-				return;
+				fprintf(stderr, "Can't map %s (%d)\n", filename, LastError());
+				return 1;
 			}
-			exit(0);
-			break;
-		case CTRL_KEY('s'):
-			EditorSave();
-			break;
-		case HOME_KEY:
-			E.cursor.X = 0;
-			break;
-		case END_KEY:
-			if (E.cursor.Y < E.linesnum)
-				E.cursor.X = E.line[E.cursor.Y].size;
-			break;
-		case CTRL_KEY('f'):
-			EditorFind();
-			break;
-		case BACKSPACE:
-		case CTRL_KEY('h'):
-		case DEL_KEY:
-			if (c == DEL_KEY)
-				EditorMoveCursor(ARROW_RIGHT);
-			EditorDelChar();
-			break;
-		case PAGE_UP:
-		case PAGE_DOWN:
+			for (unsigned int s = 0; s <= NLSCANNERS_ENTRIES; s++)
 			{
-				if (c == PAGE_UP)
-				{
-					E.cursor.Y = E.offset.Y;
-				}
-				else if (c == PAGE_DOWN)
+				struct NewlineScanner *scanner = (s < NLSCANNERS_ENTRIES) ? &NLSCANNERS[s] : NewlineScanner();
+				if (!NewlineScannerSupported(scanner))
 				{
-					E.cursor.Y = E.offset.Y + E.bufSize.Y - 1;
-					if (E.cursor.Y > E.linesnum)
-						E.cursor.Y = E.linesnum;
+					printf(" %10s", "n/a");
+					continue;
 				}
-				int times = E.bufSize.Y;
-				while (times--)
-					EditorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+				t = ClockNow();
+				EditorIndexBuffer(E.base, E.basesize, scanner, (s < NLSCANNERS_ENTRIES) ? 1 : threads);
+				printf(" %8.0fms", (ClockNow() - t) * 1000);
+				BenchResetLines();
 			}
+			printf("\n");
+			EditorUnmapFile();
+			remove(filename);
+		}
+	}
+
+	free(E.line);
+	return 0;
+}
+
+// One step of a redraw scenario: scrolling by a line, paging, typing.
+void BenchRedrawStep(int scenario)
+{
+	switch (scenario)
+	{
+		case 0:
+			EditorMoveCursor(ARROW_DOWN);
 			break;
-		case ARROW_UP:
-		case ARROW_DOWN:
-		case ARROW_LEFT:
-		case ARROW_RIGHT:
-			EditorMoveCursor(c);
-			break;
-		case CTRL_KEY('l'):
-		case '\x1b':
+		case 1:
+			for (int j = 0; j < E.bufSize.Y; j++)
+				EditorMoveCursor(ARROW_DOWN);
 			break;
-		default:
-			EditorInsertChar(c);
+		case 2:
+			EditorInsertChar('x');
 			break;
 	}
-
-	quit_times = KILO_QUIT_TIMES;
 }
 
-// https://learn.microsoft.com/en-us/windows/console/reading-input-buffer-events
-int HandleInputs(void)
+// winkilo --bench-redraw FILE [COLUMNS ROWS]
+// Reports the bytes written and the frames drawn per second while
+// scrolling, paging and typing through FILE, once with differential output
+// and once with every frame written in full. Output is only counted, so the
+// rates measure drawing and encoding. The screen defaults to 120x40.
+int BenchRedraw(int argc, char *argv[])
 {
-	int i;
-	int c;
-	DWORD cInRead;
-	INPUT_RECORD irInBuf[MAXINREC];
+	char *names[] = { "scroll", "page", "type" };
+	int steps[] = { 1000, 100, 1000 };
 
-	if (!ReadConsoleInput(E.hStdin, irInBuf, 128, &cInRead))
+	if (argc < 1)
 	{
-		fprintf(stderr, "Error read input events: (%d)\n", GetLastError());
-		exit(1);
+		fprintf(stderr, "Usage: winkilo --bench-redraw FILE [COLUMNS ROWS]\n");
+		return 1;
 	}
+	E.bufSize.X = (argc > 2) ? atoi(argv[1]) : 120;
+	E.bufSize.Y = ((argc > 2) ? atoi(argv[2]) : 40) - 2;
+	E.term = NULL;
+	EditorOpen(argv[0]);
 
-	for (i = 0; i < cInRead; ++i)
+	printf("%-8s %8s %14s %14s %10s %10s\n", "scenario", "frames", "diff_b/frame", "full_b/frame", "diff_fps", "full_fps");
+	for (int s = 0; s < 3; s++)
 	{
-		switch (irInBuf[i].EventType)
+		size_t bytes[2] = { 0, 0 };
+		double secs[2] = { 0, 0 };
+		for (int full = 0; full < 2; full++)
 		{
-			case KEY_EVENT:
-				if (!irInBuf[i].Event.KeyEvent.bKeyDown)
-					continue;
-
-				c = irInBuf[i].Event.KeyEvent.uChar.AsciiChar;
-				
-				if (c == '\x1b' && (i + cInRead) > 2)
-				{
-					i++;
-					char seq[3];
-					seq[0] = irInBuf[i].Event.KeyEvent.uChar.AsciiChar; i++;
-					seq[1] = irInBuf[i].Event.KeyEvent.uChar.AsciiChar; i++;
-
-					if (seq[0] == '[')
-					{
-						if (seq[1] >= '0' && seq[1] <= '9')
-						{
-							seq[2] = irInBuf[i].Event.KeyEvent.uChar.AsciiChar; i++;
-
-							if (seq[2] == '~')
-							{
-								switch (seq[1])
-								{
-									case '1': c = HOME_KEY; break;
-									case '3': c = DEL_KEY; break;
-									case '4': c = END_KEY; break;
-									case '5': c = PAGE_UP; break;
-									case '6': c = PAGE_DOWN; break;
-									case '7': c = HOME_KEY; break;
-									case '8': c = END_KEY; break;
-								}
-							}
-						}
-						else
-						{
-							switch (seq[1])
-							{
-								case 'A': c = ARROW_UP; break;
-								case 'B': c = ARROW_DOWN; break;
-								case 'C': c = ARROW_RIGHT; break;
-								case 'D': c = ARROW_LEFT; break;
-								case 'H': c = HOME_KEY; break;
-								case 'F': c = END_KEY; break;
-							}
-						}
-					}
-					else if (seq[0] == 'O')
-					{
-						switch (seq[1])
-						{
-							case 'H': c = HOME_KEY; break;
-							case 'F': c = END_KEY; break;
-						}
-					}
-				}
+			E.cursor.X = E.cursor.Y = 0;
+			E.offset.X = E.offset.Y = 0;
+			E.frame_full = true;
+			EditorRefreshScreen();
+			for (int j = 0; j < steps[s]; j++)
+			{
+				BenchRedrawStep(s);
+				E.frame_full = full;
+				double t = ClockNow();
+				EditorRefreshScreen();
+				secs[full] += ClockNow() - t;
+				bytes[full] += E.frame_bytes;
+			}
+		}
+		printf("%-8s %8d %14zu %14zu %10.0f %10.0f\n", names[s], steps[s], bytes[0] / steps[s], bytes[1] / steps[s], steps[s] / secs[0], steps[s] / secs[1]);
+	}
+	JournalClose(true);
+	return 0;
+}
 
-				return c;
-				break;
+// Latencies of the key events replayed by BenchReplay, in seconds.
+struct BenchSamples {
+	double *total;
+	double *highlight;
+	double *refresh;
+	size_t len;
+	size_t cap;
+	bool started;
+	double t0;	// When the current event started.
+	double hl0;	// E.time_hl at that point.
+	double refresh0;	// E.time_refresh at that point.
+} Samples;
+
+// Closes the sample of the event handled since the last call. Runs as the
+// headless backend starts reading each event, so keys taken in by a prompt
+// are timed the same way.
+void BenchReplaySample(void)
+{
+	double now = ClockNow();
 
-			case WINDOW_BUFFER_SIZE_EVENT:
-				E.bufSize.X = irInBuf[i].Event.WindowBufferSizeEvent.dwSize.X; 
-				E.bufSize.Y = irInBuf[i].Event.WindowBufferSizeEvent.dwSize.Y - 2;
-				break;
+	if (Samples.started)
+	{
+		if (Samples.len == Samples.cap)
+		{
+			Samples.cap = Samples.cap ? Samples.cap * 2 : 1024;
+			Samples.total = realloc(Samples.total, sizeof(double) * Samples.cap);
+			Samples.highlight = realloc(Samples.highlight, sizeof(double) * Samples.cap);
+			Samples.refresh = realloc(Samples.refresh, sizeof(double) * Samples.cap);
 		}
+		Samples.total[Samples.len] = now - Samples.t0;
+		Samples.highlight[Samples.len] = E.time_hl - Samples.hl0;
+		Samples.refresh[Samples.len] = E.time_refresh - Samples.refresh0;
+		Samples.len++;
 	}
+	Samples.started = true;
+	Samples.t0 = now;
+	Samples.hl0 = E.time_hl;
+	Samples.refresh0 = E.time_refresh;
+}
 
-	return 0;
+// Appends one key event to the headless script.
+void BenchAddEvent(const char *bytes, size_t len)
+{
+	Headless.input = realloc(Headless.input, Headless.inputlen + len);
+	memcpy(&Headless.input[Headless.inputlen], bytes, len);
+	Headless.inputlen += len;
+	Headless.events = realloc(Headless.events, sizeof(size_t) * (Headless.nevents + 1));
+	Headless.events[Headless.nevents++] = Headless.inputlen;
 }
 
-/*** Initialize ***/
-int InitEditorConsole(void)
+int BenchCompareDouble(const void *a, const void *b)
 {
-	DWORD dwMode;
-	CONSOLE_SCREEN_BUFFER_INFO csbi;
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// Prints "name":{"p50":..,"p99":..,"max":..} in microseconds. Sorts v.
+void BenchPrintPercentiles(char *name, double *v, size_t n)
+{
+	qsort(v, n, sizeof(double), BenchCompareDouble);
+	printf("\"%s\":{\"p50\":%.1f,\"p99\":%.1f,\"max\":%.1f}", name,
+		v[n / 2] * 1e6, v[n - 1 - n / 100] * 1e6, v[n - 1] * 1e6);
+}
 
-	E.hStdout = GetStdHandle(STD_OUTPUT_HANDLE);
-	E.hStdin = GetStdHandle(STD_INPUT_HANDLE);
+// Replays the events added since the last run, drawing a frame after each
+// one, and prints their latencies as one JSON object.
+void BenchReplayRun(char *name, bool first)
+{
+	size_t j;
 
-	if (E.hStdout == INVALID_HANDLE_VALUE)
-	{
-		fprintf(stderr, "Error: Invalid stdout handle value.\n");
-		return 0;
-	}
+	Headless.pos = 0;
+	Headless.event = 0;
+	Samples.len = 0;
+	Samples.started = false;
 
-	if (E.hStdin == INVALID_HANDLE_VALUE)
+	E.frame_full = true;
+	EditorRefreshScreen();
+	double t = ClockNow();
+	while (Headless.pos < Headless.inputlen)
 	{
-		fprintf(stderr, "Error: Invalid stdin handle value.\n");
-		return 0;
+		EditorRefreshScreen();
+		EditorProcessInput();
 	}
-    	
-	// Get console mode.
-    	if (!GetConsoleMode(E.hStdout, &E.dwOutMode))
+	EditorRefreshScreen();
+	BenchReplaySample();
+	t = ClockNow() - t;
+
+	// Highlighting is part of the refresh and whatever is left of an
+	// event outside of the refresh is editing.
+	double *edit = malloc(sizeof(double) * Samples.len);
+	for (j = 0; j < Samples.len; j++)
 	{
-		fprintf(stderr, "Error: Can't get stdout handle mode (%d).\n", GetLastError());
-		return 0;
+		edit[j] = Samples.total[j] - Samples.refresh[j];
+		Samples.refresh[j] -= Samples.highlight[j];
 	}
 
-	if (!GetConsoleMode(E.hStdin, &E.dwInMode))
+	printf("%s    {\"name\":\"%s\",\"events\":%zu,\"elapsed_ms\":%.1f,\"latency_us\":{",
+		first ? "" : ",\n", name, Samples.len, t * 1e3);
+	BenchPrintPercentiles("total", Samples.total, Samples.len);
+	printf(",");
+	BenchPrintPercentiles("edit", edit, Samples.len);
+	printf(",");
+	BenchPrintPercentiles("highlight", Samples.highlight, Samples.len);
+	printf(",");
+	BenchPrintPercentiles("refresh", Samples.refresh, Samples.len);
+	printf("}}");
+	fflush(stdout);
+	free(edit);
+
+	Headless.inputlen = 0;
+	Headless.nevents = 0;
+}
+
+// Writes lines of C with comments, strings, numbers and keywords.
+int BenchWriteSource(char *filename, size_t lines)
+{
+	static const char *code[] = {
+		"/* Block %zu: checks the input",
+		" * and returns the scaled value. */",
+		"static int func_%zu(int a, const char *s)",
+		"{",
+		"\t// Keywords in a comment: if return",
+		"\tif (a > 42 && s[0] == 'x') return a * 3;",
+		"\tprintf(\"value %%d of %zu\\n\", a + 0x1F);",
+		"\tfor (int i = 0; i < a; i++) a -= i;",
+		"\treturn 0;",
+		"}",
+	};
+	size_t ncode = sizeof(code) / sizeof(code[0]);
+	FILE *fp = fopen(filename, "wb");
+	if (!fp) return 0;
+
+	for (size_t j = 0; j < lines; j++)
 	{
-		fprintf(stderr, "Error: Can't get stdin handle mode (%d).\n", GetLastError());
-		return 0;
+		fprintf(fp, code[j % ncode], j / ncode);
+		fputc('\n', fp);
 	}
+	return fclose(fp) == 0;
+}
 
-	// Enable virtual terminal sequences.
-	dwMode = E.dwOutMode;
-	dwMode |= ENABLE_PROCESSED_OUTPUT; 
-	dwMode |= ENABLE_VIRTUAL_TERMINAL_PROCESSING;
+// winkilo --bench-replay [LINES]
+// Replays scripted sessions through the headless backend on a generated C
+// file of LINES lines, 1000000 by default: typing in the middle of the
+// file, pasting a block of 10000 lines, searching and jumping through the
+// matches, paging through the whole file and saving. Every key event gets
+// a frame of its own. Prints the p50, p99 and max latency per event, split
+// into edit, highlight and refresh time, and the peak RSS as JSON. The
+// highlight worker is left off so every frame does all of its work.
+int BenchReplay(int argc, char *argv[])
+{
+	char *filename = "winkilo-bench.c";
+	size_t lines = (argc > 0) ? strtoul(argv[0], NULL, 10) : 1000000;
+	int j;
 
-    	if (!SetConsoleMode(E.hStdout, dwMode))
+	if (!BenchWriteSource(filename, lines))
 	{
-		fprintf(stderr, "Error: Can't set stdout handle mode (%d).\n", GetLastError());
-		return 0;
+		fprintf(stderr, "Can't write %s: %s\n", filename, strerror(errno));
+		return 1;
 	}
 
-	// Enable mouse and key input events.
-	E.dwInMode &= (~ENABLE_VIRTUAL_TERMINAL_INPUT);
-	E.dwInMode |= ENABLE_ECHO_INPUT;
-	E.dwInMode |= ENABLE_LINE_INPUT;
-	E.dwInMode |= ENABLE_PROCESSED_INPUT;
-	E.dwInMode |= ENABLE_QUICK_EDIT_MODE;
-
-	dwMode = E.dwInMode;
+	E.term = &HeadlessBackend;
+	Headless.onevent = BenchReplaySample;
+	if (!InitEditorConsole())
+		return 1;
+	double t = ClockNow();
+	EditorOpen(filename);
+	t = ClockNow() - t;
 
-	dwMode &= (~ENABLE_ECHO_INPUT);		// Required to prevent characters from showing
-	dwMode &= (~ENABLE_LINE_INPUT);		// Required to process every single character without pressing 'Enter'
-	dwMode &= (~ENABLE_PROCESSED_INPUT);	// Disable Ctrl-C
-	dwMode |= ENABLE_EXTENDED_FLAGS; 
-	dwMode |= ENABLE_WINDOW_INPUT; 
-	dwMode |= ENABLE_VIRTUAL_TERMINAL_INPUT;
+	printf("{\n  \"version\":\"%s\",\"lines\":%zu,\"columns\":%d,\"rows\":%d,\"open_ms\":%.1f,\n  \"scenarios\":[\n",
+		KILO_VERSION, lines, E.bufSize.X, E.bufSize.Y + 2, t * 1e3);
 
-	if (!SetConsoleMode(E.hStdin, dwMode))
+	E.cursor.X = 0;
+	E.cursor.Y = E.linesnum / 2;
+	const char *typed = "\tint x = y + 42; // typed\r";
+	for (j = 0; j < 2000; j++)
+		BenchAddEvent(&typed[j % strlen(typed)], 1);
+	BenchReplayRun("type", true);
+
+	struct abuf paste = ABUF_INIT;
+	abAppend(&paste, "\x1b[200~", 6);
+	for (j = 0; j < 10000; j++)
 	{
-		fprintf(stderr, "Error: Can't set stdin handle mode (%d).\n", GetLastError());
-		return 0;
+		char buf[64];
+		int len = snprintf(buf, sizeof(buf), "\tpasted_%d = \"%d\"; /* pasted */\r", j, j);
+		abAppend(&paste, buf, len);
 	}
+	abAppend(&paste, "\x1b[201~", 6);
+	BenchAddEvent(paste.b, paste.len);
+	abFree(&paste);
+	BenchReplayRun("paste", false);
+
+	E.cursor.X = E.cursor.Y = 0;
+	BenchAddEvent("\x06", 1);
+	for (const char *q = "return"; *q; q++)
+		BenchAddEvent(q, 1);
+	for (j = 0; j < 500; j++)
+		BenchAddEvent("\x1b[B", 3);
+	BenchAddEvent("\r", 1);
+	BenchReplayRun("search", false);
+
+	E.cursor.X = E.cursor.Y = 0;
+	for (j = 0; j <= (int)(E.linesnum / E.bufSize.Y); j++)
+		BenchAddEvent("\x1b[6~", 4);
+	BenchReplayRun("scroll", false);
+
+	BenchAddEvent("\x13", 1);
+	BenchReplayRun("save", false);
+	EditorSaveFinish(true);
+
+	printf("\n  ],\n  \"peak_rss_kb\":%zu\n}\n", PeakRSS() / 1024);
+	JournalClose(true);
+	remove(filename);
+	return 0;
+}
 
-	// Switch to a new alternate screen buffer.
-	printf("\x1b[?1049h");
-	printf("\x1b]0;%s\x07", KILO_TITLE);
+/*** Initialize ***/
 
-	// Retrieves information about the current console screen buffer.
-	GetConsoleScreenBufferInfo(E.hStdout, &csbi);
-	E.bufSize.Y = csbi.dwSize.Y - 2;
-	E.bufSize.X = csbi.dwSize.X; 
+// Sets up the locks shared with the worker threads, once for the process.
+void InitLocks(void)
+{
+	static bool done = false;
+
+	if (done) return;
+	MutexInit(&E.lock);
+	CondInit(&E.hl_wake);
+	MutexInit(&Journal.lock);
+	CondInit(&Journal.wake);
+	MutexInit(&Save.lock);
+	done = true;
+}
+
+int InitEditorConsole(void)
+{
 	E.offset.X = 0;
 	E.offset.Y = 0;
 	E.cursor.X = 0;
 	E.cursor.Y = 0;
 	E.rx = 0;
 	E.linesnum = 0;
+	E.linecap = 0;
+	E.gap = 0;
+	E.hl_valid = 0;
+	E.base = NULL;
+	E.basesize = 0;
+	E.basemapped = false;
 	E.line = NULL;
 	E.dirty = 0;
 	E.filename = NULL;
 	E.statusmsg[0] = '\0';
 	E.statusmsg_time = 0;
 	E.syntax = NULL;
-
-	return 1;
+	E.hl_worker = false;
+	E.hl_pending = false;
+	E.hl_gen = 0;
+	E.frame.ch = NULL;
+	E.shown.ch = NULL;
+	E.frame_full = true;
+	E.frame_bytes = 0;
+	E.frame_time = 0;
+	E.time_refresh = 0;
+	E.time_hl = 0;
+	memset(&E.input, 0, sizeof(E.input));
+	InitLocks();
+	EditorLock();
+
+	return E.term->init();
 }
 
 void ExitEditorConsole(void)
 {
+	// Left behind by anything but Ctrl-Q, the journal keeps unsaved edits.
+	EditorSaveFinish(true);
+	JournalClose(E.dirty == 0);
+	EditorStopHighlighter();
 	free(E.filename);
 	free(E.line);
+	free(E.frame.ch);
+	free(E.shown.ch);
+	EditorUnmapFile();
+	PerfTraceClose();
 
-	// Reset console settings.
-	if (E.hStdout != INVALID_HANDLE_VALUE && E.dwOutMode)
+	if (E.term)
+		E.term->exit();
+}
+
+int main(int argc, char *argv[])
+{
+	InitLocks();
+	if (argc > 1 && !strcmp(argv[1], "--bench-scan"))
+		return BenchScan(argc - 2, argv + 2);
+	if (argc > 1 && !strcmp(argv[1], "--bench-redraw"))
 	{
-		printf("\x1b[!p");	// Reset console settings.
-		printf("\x1b[?1049l");	// Switch back to the main buffer.
-		SetConsoleMode(E.hStdout, E.dwOutMode);
+		EditorLoadSyntaxes(argv[0]);
+		return BenchRedraw(argc - 2, argv + 2);
+	}
+	if (argc > 1 && !strcmp(argv[1], "--bench-replay"))
+	{
+		EditorLoadSyntaxes(argv[0]);
+		return BenchReplay(argc - 2, argv + 2);
 	}
 
-	if (E.hStdin != INVALID_HANDLE_VALUE && E.dwInMode)
+	EditorLoadSyntaxes(argv[0]);
+
+#ifdef _WIN32
+	E.term = &Win32Backend;
+#else
+	E.term = &PosixBackend;
+#endif
+	if (argc > 1 && !strcmp(argv[1], "--trace"))
+	{
+		if (argc < 3 || !PerfTraceOpen(argv[2]))
+		{
+			fprintf(stderr, "Usage: winkilo --trace FILE [--headless SCRIPT CAPTURE] [FILE]\n");
+			return 1;
+		}
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc > 1 && !strcmp(argv[1], "--headless"))
 	{
-		SetConsoleMode(E.hStdin, E.dwInMode);
+		if (argc < 4 || !HeadlessLoad(argv[2], strcmp(argv[3], "-") ? argv[3] : NULL))
+		{
+			fprintf(stderr, "Usage: winkilo --headless SCRIPT CAPTURE [FILE]\n");
+			return 1;
+		}
+		E.term = &HeadlessBackend;
+		argc -= 3;
+		argv += 3;
 	}
-}
 
-int main(int argc, char *argv[])
-{
 	atexit(ExitEditorConsole);
 	
 	if (!InitEditorConsole()) exit(1);
 
+	EditorSetStatusMessage("HELP: Ctrl-F find, R replace, S save, Q quit, Z undo, Y redo, P timings");
 	if (argc > 1)
 	{
 		EditorOpen(argv[1]);
 	}
 
-	EditorSetStatusMessage("HELP: Ctrl-F = find | Ctrl-S = save | Ctrl-Q = quit");
+	EditorStartHighlighter();
 	
 	while (1)
 	{
 		EditorRefreshScreen();
-		HandleKeyPress();
+		EditorProcessInput();
 	}
 	
 	return 0;